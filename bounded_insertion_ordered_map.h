@@ -0,0 +1,169 @@
+#ifndef _BOUNDED_INSERTION_ORDERED_MAP_H
+#define _BOUNDED_INSERTION_ORDERED_MAP_H
+
+#include "insertion_ordered_map.h"
+
+#include <functional>
+
+enum class eviction_policy { fifo, lru };
+
+/*
+ * insertion_ordered_map with a limit on the number of entries and,
+ * optionally, on their total size as measured by a size function. When an
+ * insertion exceeds a limit, the oldest entries are evicted. Under the LRU
+ * policy at() and re-insertion move the key to the back of the order;
+ * under FIFO the order is the order of first insertion.
+ *
+ * Values are only handed out as const references, so that the size of an
+ * entry measured on insertion stays valid until it is evicted.
+ */
+template <class K, class V, class Hash = iom_hash<K>>
+class bounded_insertion_ordered_map {
+public:
+    using size_function = std::function<size_t(K const &, V const &)>;
+    using eviction_callback = std::function<void(K const &, V const &)>;
+    using iterator = typename insertion_ordered_map<K, V, Hash>::iterator;
+
+private:
+    insertion_ordered_map<K, V, Hash> map;
+    eviction_policy policy;
+    size_t max_entries;
+    size_t max_bytes;
+    size_t bytes;
+    size_function entry_size;
+    eviction_callback on_evict;
+
+    bool over_limit() const {
+        return map.size() > max_entries || (entry_size && bytes > max_bytes);
+    }
+
+    // The callback runs before the entry is removed; if it throws, the
+    // entry stays.
+    void evict_oldest() {
+        auto oldest = *map.begin();
+
+        if(on_evict)
+            on_evict(oldest.first, oldest.second);
+        if(entry_size)
+            bytes -= entry_size(oldest.first, oldest.second);
+
+        map.pop_front();
+    }
+
+    void touch(K const &k) {
+        if(policy == eviction_policy::lru)
+            map.move_to_back(k);
+    }
+
+public:
+
+    explicit bounded_insertion_ordered_map(size_t max_entries,
+                                           eviction_policy policy = eviction_policy::lru) :
+            map(),
+            policy(policy),
+            max_entries(max_entries),
+            max_bytes(0),
+            bytes(0),
+            entry_size(),
+            on_evict() {}
+
+    // Limits the sum of entry_size over all entries; applied from now on.
+    void set_byte_budget(size_t budget, size_function size) {
+        size_t measured = 0;
+        for(auto it = map.begin(), end = map.end(); it != end; ++it)
+            measured += size((*it).first, (*it).second);
+
+        max_bytes = budget;
+        bytes = measured;
+        entry_size = std::move(size);
+
+        while(over_limit())
+            evict_oldest();
+    }
+
+    void set_eviction_callback(eviction_callback callback) {
+        on_evict = std::move(callback);
+    }
+
+    /*
+     * Same as insertion_ordered_map::insert, except that a present key is
+     * only moved to the back under the LRU policy. May evict other entries.
+     */
+    bool insert(K const &k, V const &v) {
+        if(map.contains(k)) {
+            touch(k);
+            return false;
+        }
+
+        size_t added = entry_size ? entry_size(k, v) : 0;
+
+        map.insert(k, v);
+        bytes += added;
+
+        while(over_limit())
+            evict_oldest();
+        return true;
+    }
+
+    // Replaces the value of k, or inserts it, and places it at the back.
+    void insert_or_assign(K const &k, V const &v) {
+        if(map.contains(k))
+            erase(k);
+        insert(k, v);
+    }
+
+    void erase(K const &k) {
+        if(entry_size)
+            bytes -= entry_size(k, static_cast<insertion_ordered_map<K, V, Hash> const &>(map).at(k));
+
+        map.erase(k);
+    }
+
+    V const &at(K const &k) {
+        touch(k);
+
+        return static_cast<insertion_ordered_map<K, V, Hash> const &>(map).at(k);
+    }
+
+    V const &at(K const &k) const {
+        return map.at(k);
+    }
+
+    bool contains(K const &k) const {
+        return map.contains(k);
+    }
+
+    size_t size() const noexcept {
+        return map.size();
+    }
+
+    bool empty() const noexcept {
+        return map.empty();
+    }
+
+    size_t capacity() const noexcept {
+        return max_entries;
+    }
+
+    // Total size of the entries according to the size function, if set.
+    size_t byte_size() const noexcept {
+        return bytes;
+    }
+
+    void clear() noexcept {
+        map.clear();
+        bytes = 0;
+    }
+
+    // Iterators //
+
+    iterator begin() const {
+        return map.begin();
+    }
+
+    iterator end() const {
+        return map.end();
+    }
+};
+
+#endif
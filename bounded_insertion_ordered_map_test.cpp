@@ -0,0 +1,176 @@
+// Tests of bounded_insertion_ordered_map.h. Build and run with
+//     g++ -std=c++17 -pthread -fsanitize=address,undefined bounded_insertion_ordered_map_test.cpp && ./a.out
+
+#include "bounded_insertion_ordered_map.h"
+
+#include <algorithm>
+#include <cassert>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+    using bounded = bounded_insertion_ordered_map<int, std::string>;
+    using model = std::vector<std::pair<int, std::string>>;
+
+    model entries(bounded const &m)
+    {
+        model result;
+        for (auto it = m.begin(), end = m.end(); it != end; ++it)
+            result.emplace_back((*it).first, (*it).second);
+        return result;
+    }
+
+    size_t entry_size(int, std::string const &v)
+    {
+        return v.size();
+    }
+
+    // Runs random operations against a vector kept in eviction order.
+    void test_eviction_order(eviction_policy policy, bool budgeted)
+    {
+        std::mt19937 random(31);
+        size_t const capacity = 50, budget = 400;
+
+        bounded m(capacity, policy);
+        model expected;
+        std::vector<int> evicted, expected_evicted;
+        size_t bytes = 0;
+
+        if (budgeted)
+            m.set_byte_budget(budget, entry_size);
+        m.set_eviction_callback([&evicted](int k, std::string const &) {
+            evicted.push_back(k);
+        });
+
+        auto find = [&expected](int k) {
+            return std::find_if(expected.begin(), expected.end(), [k](auto const &e) { return e.first == k; });
+        };
+        auto evict = [&] {
+            while (expected.size() > capacity || (budgeted && bytes > budget)) {
+                expected_evicted.push_back(expected.front().first);
+                bytes -= expected.front().second.size();
+                expected.erase(expected.begin());
+            }
+        };
+
+        for (int op = 0; op < 20000; ++op) {
+            int k = random() % 120;
+            std::string v(random() % 20, 'a' + op % 26);
+            auto it = find(k);
+            bool present = it != expected.end();
+
+            switch (random() % 5) {
+            case 0:
+            case 1:
+                assert(m.insert(k, v) == !present);
+                if (!present) {
+                    expected.emplace_back(k, v);
+                    bytes += v.size();
+                    evict();
+                }
+                else if (policy == eviction_policy::lru) {
+                    std::rotate(it, it + 1, expected.end());
+                }
+                break;
+            case 2:
+                m.insert_or_assign(k, v);
+                if (present) {
+                    bytes -= it->second.size();
+                    expected.erase(it);
+                }
+                expected.emplace_back(k, v);
+                bytes += v.size();
+                evict();
+                break;
+            case 3:
+                if (present) {
+                    assert(m.at(k) == it->second);
+                    if (policy == eviction_policy::lru)
+                        std::rotate(it, it + 1, expected.end());
+                }
+                break;
+            case 4:
+                if (present) {
+                    m.erase(k);
+                    bytes -= it->second.size();
+                    expected.erase(it);
+                }
+                break;
+            }
+
+            assert(m.size() <= capacity);
+            if (op % 100 == 0) {
+                assert(entries(m) == expected);
+                assert(evicted == expected_evicted);
+                assert(!budgeted || m.byte_size() == bytes);
+            }
+        }
+        assert(entries(m) == expected);
+        assert(evicted == expected_evicted);
+    }
+
+    void test_limits()
+    {
+        bounded m(3, eviction_policy::fifo);
+        m.insert(1, "a");
+        m.insert(2, "bb");
+        m.insert(3, "ccc");
+
+        // under FIFO neither at() nor re-insertion reorders
+        assert(m.at(1) == "a");
+        assert(!m.insert(1, "ignored"));
+        m.insert(4, "dddd");
+        assert((entries(m) == model{{2, "bb"}, {3, "ccc"}, {4, "dddd"}}));
+
+        // a budget applied later evicts at once
+        m.set_byte_budget(7, entry_size);
+        assert((entries(m) == model{{3, "ccc"}, {4, "dddd"}}));
+        assert(m.byte_size() == 7);
+
+        // an entry larger than the budget evicts everything, itself included
+        m.insert(5, "eeeeeeee");
+        assert(m.empty() && m.byte_size() == 0);
+
+        // the entry whose eviction callback throws stays
+        m.insert(6, "f");
+        m.set_eviction_callback([](int, std::string const &) {
+            throw std::runtime_error("evict");
+        });
+        bool thrown = false;
+        try {
+            m.insert(7, "ggggggg");
+        }
+        catch (std::runtime_error const &) {
+            thrown = true;
+        }
+        assert(thrown && m.contains(6) && m.contains(7));
+
+        bounded const &c = m;
+        assert(c.at(6) == "f");
+        bool missing = false;
+        try {
+            m.at(8);
+        }
+        catch (lookup_error const &) {
+            missing = true;
+        }
+        assert(missing);
+
+        m.clear();
+        assert(m.empty() && m.byte_size() == 0 && m.capacity() == 3);
+    }
+}
+
+int main()
+{
+    test_eviction_order(eviction_policy::lru, false);
+    test_eviction_order(eviction_policy::fifo, false);
+    test_eviction_order(eviction_policy::lru, true);
+    test_eviction_order(eviction_policy::fifo, true);
+    test_limits();
+
+    return 0;
+}
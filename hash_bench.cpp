@@ -0,0 +1,74 @@
+// Benchmark of std::hash against iom_hash on sequential and strided long
+// keys. Build and run with
+//     g++ -std=c++17 -O2 -pthread hash_bench.cpp && ./a.out
+//
+// std::hash is the identity on libstdc++. The index mixes every hash before
+// using it, so these keys do not form clusters with either hash.
+
+#include "insertion_ordered_map.h"
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <vector>
+
+namespace {
+    double since(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Times inserting, finding and erasing every key.
+    template <class Hash>
+    void run(char const *name, std::vector<long> const &keys)
+    {
+        insertion_ordered_map<long, long, Hash> m;
+
+        auto start = std::chrono::steady_clock::now();
+        for (long k : keys)
+            m.insert(k, k);
+        double insert = since(start);
+
+        start = std::chrono::steady_clock::now();
+        long found = 0;
+        for (long k : keys)
+            found += m.contains(k);
+        double find = since(start);
+
+        start = std::chrono::steady_clock::now();
+        for (long k : keys)
+            m.erase(k);
+        double erase = since(start);
+
+        if (found != static_cast<long>(keys.size()) || !m.empty())
+            std::printf("wrong result\n");
+        std::printf("  %-10s %8zu keys  insert %8.0f ms  find %8.0f ms  erase %8.0f ms\n",
+                    name, keys.size(), insert, find, erase);
+        std::fflush(stdout);
+    }
+
+    // Keys f(0), ..., f(count - 1).
+    template <class F>
+    void compare(char const *distribution, size_t count, F f)
+    {
+        std::vector<long> keys(count);
+        for (size_t i = 0; i < count; ++i)
+            keys[i] = f(static_cast<long>(i));
+
+        std::printf("%s:\n", distribution);
+        std::fflush(stdout);
+        run<std::hash<long>>("std::hash", keys);
+        run<iom_hash<long>>("iom_hash", keys);
+    }
+}
+
+int main()
+{
+    size_t const count = 1000000;
+
+    compare("sequential keys", count, [](long i) { return i; });
+    compare("i << 21", count, [](long i) { return i << 21; });
+    compare("3i << 32", count, [](long i) { return 3 * i << 32; });
+
+    return 0;
+}
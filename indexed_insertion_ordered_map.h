@@ -0,0 +1,317 @@
+#ifndef _INDEXED_INSERTION_ORDERED_MAP_H
+#define _INDEXED_INSERTION_ORDERED_MAP_H
+
+#include "insertion_ordered_map.h"
+
+struct iom_identity {
+    template <class T>
+    T const &operator()(T const &t) const noexcept {
+        return t;
+    }
+};
+
+/*
+ * insertion_ordered_map with a secondary index from project(value) to the
+ * keys with that projection, in insertion order. The index is kept up to
+ * date by every modification, so keys_with() costs in proportion to its
+ * result rather than to the map. Buckets of keys are insertion_ordered_maps
+ * themselves, so the index is shared by copies of the map, like its entries,
+ * and copied page by page as it is written.
+ *
+ * Values are changed only through update(), or by assigning through what
+ * operator[] returns, which moves the key to the bucket of its new value
+ * right away; at() gives out const references only.
+ */
+template <class K, class V, class Project = iom_identity, class Hash = iom_hash<K>>
+class indexed_insertion_ordered_map {
+public:
+    using projection_type = std::decay_t<std::invoke_result_t<Project, V const &>>;
+    using map_type = insertion_ordered_map<K, V, Hash>;
+    using iterator = typename map_type::iterator;
+
+    // Keys in insertion order; the values are unused.
+    using key_set = insertion_ordered_map<K, bool, Hash>;
+
+private:
+    /*
+     * The keys of a bucket are in insertion order up to sorted. A key whose
+     * projection changes usually does not belong at the back of its new
+     * bucket, but is appended there anyway, and the keys from the first one
+     * out of order on are put in order by sort() when the bucket is read.
+     */
+    struct bucket {
+        key_set keys;
+        size_t sorted;
+    };
+
+    using index_type = insertion_ordered_map<projection_type, bucket, iom_hash<projection_type>>;
+
+    map_type map;
+    index_type index;
+    Project project;
+
+    // The projection k is indexed under; k has to be present.
+    projection_type indexed(K const &k) const {
+        return project(map.at(k));
+    }
+
+    // Adds k at the back of the bucket of p; in_order if it belongs there.
+    void add(projection_type const &p, K const &k, bool in_order) {
+        auto make = [&k] {
+            bucket b{key_set(), 1};
+            b.keys.insert(k, true);
+            return b;
+        };
+        auto append = [&k, in_order](bucket &b) {
+            bool was_sorted = b.sorted == b.keys.size();
+            b.keys.insert(k, true);
+            if(was_sorted && in_order)
+                b.sorted++;
+        };
+        index.upsert(p, make, append);
+    }
+
+    void remove(projection_type const &p, K const &k) {
+        bool emptied = false;
+        index.update(p, [&k, &emptied](bucket &b) {
+            if(b.keys.position_of(k) < b.sorted)
+                b.sorted--;
+            b.keys.erase(k);
+            emptied = b.keys.empty();
+        });
+
+        if(emptied)
+            index.erase(p);
+    }
+
+    // Adds k, which is already in the map, to the bucket of p.
+    void place(projection_type const &p, K const &k) {
+        bool in_order = true;
+        if(index.contains(p)) {
+            key_set const &keys = std::as_const(index).at(p).keys;
+            in_order = map.position_of((*keys.nth(keys.size() - 1)).first) < map.position_of(k);
+        }
+        add(p, k, in_order);
+    }
+
+    // Merges the keys after b.sorted into the ones before, by position.
+    void sort(bucket &b) {
+        using positioned = std::pair<size_t, K>;
+        auto earlier = [](positioned const &x, positioned const &y) {
+            return x.first < y.first;
+        };
+
+        std::vector<positioned> added;
+        for(auto it = b.keys.nth(b.sorted), end = b.keys.end(); it != end; ++it)
+            added.emplace_back(map.position_of((*it).first), (*it).first);
+        std::sort(added.begin(), added.end(), earlier);
+
+        // the sorted keys before the first one added stay where they are
+        size_t low = 0, high = b.sorted;
+        while(low < high) {
+            size_t middle = low + (high - low) / 2;
+            if(map.position_of((*b.keys.nth(middle)).first) < added.front().first)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+
+        std::vector<positioned> later;
+        for(auto it = b.keys.nth(low), end = b.keys.nth(b.sorted); it != end; ++it)
+            later.emplace_back(map.position_of((*it).first), (*it).first);
+
+        std::vector<positioned> merged(later.size() + added.size());
+        std::merge(later.begin(), later.end(), added.begin(), added.end(), merged.begin(), earlier);
+        for(positioned const &key: merged)
+            b.keys.move_to_back(key.second);
+        b.sorted = b.keys.size();
+    }
+
+    // Moves k from the bucket of before to that of its value, if they differ.
+    void reindex(K const &k, projection_type const &before) {
+        projection_type after = indexed(k);
+        if(!(after == before)) {
+            remove(before, k);
+            place(after, k);
+        }
+    }
+
+    template <class F>
+    void for_bucket_of(K const &k, F f) {
+        index.update(indexed(k), f);
+    }
+
+public:
+
+    /*
+     * What operator[] returns: reads see the value, and assigning to it
+     * goes through update().
+     */
+    class reference {
+    private:
+        friend class indexed_insertion_ordered_map;
+
+        indexed_insertion_ordered_map &owner;
+        K key;
+
+        reference(indexed_insertion_ordered_map &owner, K const &key) :
+                owner(owner),
+                key(key) {}
+
+    public:
+        reference &operator=(V const &v) {
+            owner.update(key, [&v](V &value) {
+                value = v;
+            });
+            return *this;
+        }
+
+        operator V const &() const {
+            return owner.at(key);
+        }
+    };
+
+    explicit indexed_insertion_ordered_map(Project project = Project()) :
+            map(),
+            index(),
+            project(std::move(project)) {}
+
+    // Same as insertion_ordered_map::insert.
+    bool insert(K const &k, V const &v) {
+        if(map.contains(k)) {
+            move_to_back(k);
+            return false;
+        }
+
+        projection_type p = project(v);
+        add(p, k, true);
+        try {
+            map.insert(k, v);
+        }
+        catch (...) {
+            remove(p, k);
+            throw;
+        }
+        return true;
+    }
+
+    void erase(K const &k) {
+        if(!map.contains(k)) throw lookup_error();
+
+        remove(indexed(k), k);
+        map.erase(k);
+    }
+
+    void move_to_back(K const &k) {
+        if(!map.contains(k)) throw lookup_error();
+
+        // the bucket stays sorted if it was
+        for_bucket_of(k, [&k](bucket &b) {
+            if(b.sorted < b.keys.size() && b.keys.position_of(k) < b.sorted)
+                b.sorted--;
+            b.keys.move_to_back(k);
+        });
+        map.move_to_back(k);
+    }
+
+    void move_to_front(K const &k) {
+        if(!map.contains(k)) throw lookup_error();
+
+        for_bucket_of(k, [&k](bucket &b) {
+            if(b.keys.position_of(k) >= b.sorted)
+                b.sorted++;
+            b.keys.move_to_front(k);
+        });
+        map.move_to_front(k);
+    }
+
+    void pop_front() {
+        if(map.empty()) throw lookup_error();
+
+        erase((*map.begin()).first);
+    }
+
+    V const &at(K const &k) const {
+        return map.at(k);
+    }
+
+    // Like insertion_ordered_map::operator[], a present k is moved to the back.
+    reference operator[](K const &k) {
+        insert(k, V());
+
+        return reference(*this, k);
+    }
+
+    /*
+     * Same as insertion_ordered_map::update; k is moved to its new bucket
+     * right away. If fn throws, k is moved to the bucket of the value fn
+     * left behind before the exception is passed on.
+     */
+    template <class F>
+    void update(K const &k, F fn) {
+        projection_type before = indexed(k);
+        try {
+            map.update(k, fn);
+        }
+        catch (...) {
+            reindex(k, before);
+            throw;
+        }
+        reindex(k, before);
+    }
+
+    bool contains(K const &k) const {
+        return map.contains(k);
+    }
+
+    size_t size() const noexcept {
+        return map.size();
+    }
+
+    bool empty() const noexcept {
+        return map.empty();
+    }
+
+    void clear() {
+        map.clear();
+        index.clear();
+    }
+
+    // Secondary index //
+
+    /*
+     * The keys whose values project to p, in insertion order. The result
+     * shares its data with the index, so it stays valid whatever happens to
+     * the map, and is O(1) to get unless keys were added to the bucket out
+     * of order since it was last read: they are then merged in, at a cost
+     * in proportion to the keys from the first of them on.
+     */
+    key_set keys_with(projection_type const &p) {
+        if(!index.contains(p))
+            return key_set();
+
+        bucket const &b = std::as_const(index).at(p);
+        if(b.sorted < b.keys.size()) {
+            index.update(p, [this](bucket &changed) {
+                sort(changed);
+            });
+        }
+        return std::as_const(index).at(p).keys;
+    }
+
+    size_t count_with(projection_type const &p) const {
+        return index.contains(p) ? std::as_const(index).at(p).keys.size() : 0;
+    }
+
+    // Iterators //
+
+    iterator begin() const {
+        return map.begin();
+    }
+
+    iterator end() const {
+        return map.end();
+    }
+};
+
+#endif
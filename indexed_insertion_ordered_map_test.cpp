@@ -0,0 +1,202 @@
+// Tests of indexed_insertion_ordered_map.h. Build and run with
+//     g++ -std=c++17 -pthread -fsanitize=address,undefined indexed_insertion_ordered_map_test.cpp && ./a.out
+
+#include "indexed_insertion_ordered_map.h"
+
+#include <algorithm>
+#include <cassert>
+#include <random>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace {
+    struct last_digit {
+        int operator()(int v) const
+        {
+            return v % 10;
+        }
+    };
+
+    using indexed = indexed_insertion_ordered_map<int, int, last_digit>;
+    using model = std::vector<std::pair<int, int>>;
+
+    std::vector<int> keys(indexed::key_set const &s)
+    {
+        std::vector<int> result;
+        for (auto it = s.begin(), end = s.end(); it != end; ++it)
+            result.push_back((*it).first);
+        return result;
+    }
+
+    // The keys of expected with values ending in digit, in order.
+    std::vector<int> keys_with(model const &expected, int digit)
+    {
+        std::vector<int> result;
+        for (auto const &e : expected) {
+            if (e.second % 10 == digit)
+                result.push_back(e.first);
+        }
+        return result;
+    }
+
+    void check(indexed &m, model const &expected)
+    {
+        assert(m.size() == expected.size());
+        auto it = m.begin();
+        for (auto const &e : expected) {
+            assert((*it).first == e.first && (*it).second == e.second);
+            ++it;
+        }
+        for (int digit = 0; digit < 10; ++digit) {
+            std::vector<int> wanted = keys_with(expected, digit);
+            assert(keys(m.keys_with(digit)) == wanted);
+            assert(m.count_with(digit) == wanted.size());
+        }
+    }
+
+    // Runs random operations against a vector of the expected entries.
+    void test_operations()
+    {
+        std::mt19937 random(46);
+        indexed m;
+        model expected;
+
+        auto find = [&expected](int k) {
+            return std::find_if(expected.begin(), expected.end(), [k](auto const &e) { return e.first == k; });
+        };
+
+        for (int op = 0; op < 20000; ++op) {
+            int k = random() % 200;
+            int v = random() % 1000;
+            auto it = find(k);
+            bool present = it != expected.end();
+
+            switch (random() % 7) {
+            case 0:
+            case 1:
+                assert(m.insert(k, v) == !present);
+                if (present)
+                    std::rotate(it, it + 1, expected.end());
+                else
+                    expected.emplace_back(k, v);
+                break;
+            case 2:
+                if (present) {
+                    m.erase(k);
+                    expected.erase(it);
+                }
+                break;
+            case 3:
+                if (present) {
+                    m.move_to_back(k);
+                    std::rotate(it, it + 1, expected.end());
+                }
+                break;
+            case 4:
+                if (present) {
+                    m.move_to_front(k);
+                    std::rotate(expected.begin(), it, it + 1);
+                }
+                break;
+            case 5:
+                if (present) {
+                    m.update(k, [v](int &value) { value = v; });
+                    it->second = v;
+                }
+                break;
+            case 6:
+                // a present key moves to the back, like in insertion_ordered_map
+                m[k] = v;
+                if (present)
+                    std::rotate(it, it + 1, expected.end());
+                else
+                    expected.emplace_back(k, 0);
+                expected.back().second = v;
+                break;
+            }
+
+            if (op % 200 == 0)
+                check(m, expected);
+        }
+        check(m, expected);
+
+        int read = m[expected.front().first];
+        assert(read == expected.front().second);
+        std::rotate(expected.begin(), expected.begin() + 1, expected.end());
+        check(m, expected);
+    }
+
+    // A throwing update leaves the key in the bucket of what fn left behind.
+    void test_throwing_update()
+    {
+        indexed m;
+        m.insert(1, 11);
+        m.insert(2, 21);
+
+        bool thrown = false;
+        try {
+            m.update(1, [](int &value) {
+                value = 12;
+                throw std::runtime_error("update");
+            });
+        }
+        catch (std::runtime_error const &) {
+            thrown = true;
+        }
+        assert(thrown);
+        assert(m.at(1) == 12);
+        assert(keys(m.keys_with(1)) == std::vector<int>{2});
+        assert(keys(m.keys_with(2)) == std::vector<int>{1});
+
+        thrown = false;
+        try {
+            m.update(2, [](int &) {
+                throw std::runtime_error("update");
+            });
+        }
+        catch (std::runtime_error const &) {
+            thrown = true;
+        }
+        assert(thrown);
+        assert(keys(m.keys_with(1)) == std::vector<int>{2});
+
+        bool missing = false;
+        try {
+            m.update(3, [](int &) {});
+        }
+        catch (lookup_error const &) {
+            missing = true;
+        }
+        assert(missing);
+    }
+
+    // Copies share the index until written, and do not see each other's changes.
+    void test_copies()
+    {
+        indexed m;
+        for (int i = 0; i < 100; ++i)
+            m.insert(i, i);
+
+        indexed copy(m);
+        copy.update(5, [](int &value) { value = 6; });
+        m.erase(15);
+
+        assert(keys(m.keys_with(5)).size() == 9 && keys(m.keys_with(5)).front() == 5);
+        assert(keys(copy.keys_with(5)).size() == 9 && keys(copy.keys_with(5)).front() == 15);
+        assert(keys(copy.keys_with(6)).front() == 5);
+
+        copy.clear();
+        assert(copy.empty() && copy.count_with(6) == 0);
+        assert(m.size() == 99);
+    }
+}
+
+int main()
+{
+    test_operations();
+    test_throwing_update();
+    test_copies();
+
+    return 0;
+}
@@ -1,72 +1,519 @@
 #ifndef _INSERTION_ORDERED_MAP_H
 #define _INSERTION_ORDERED_MAP_H
 
-#include <unordered_map>
-#include <list>
 #include <string>
+#include <unordered_map>
 #include <unordered_set>
 #include <memory>
 #include <algorithm>
 #include <stdexcept>
+#include <istream>
+#include <ostream>
+#include <fstream>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <type_traits>
+#include <utility>
+#include <new>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <string_view>
+#include <random>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <cstdio>
+#include <optional>
+#include <iterator>
 
 class lookup_error : std::exception { };
 
-template <class K, class V, class Hash = std::hash<K>>
+class serialization_error : std::exception { };
+
+/*
+ * Customization point for save() and load(). Trivially copyable types are
+ * written as raw bytes; specialize this template for any other key or value
+ * type stored in a map that is to be serialized.
+ */
+template <class T, class Enable = void>
+struct iom_serializer;
+
+template <class T>
+struct iom_serializer<T, std::enable_if_t<std::is_trivially_copyable<T>::value>> {
+    static void write(std::ostream &os, T const &t) {
+        os.write(reinterpret_cast<char const *>(&t), sizeof(T));
+    }
+
+    static T read(std::istream &is) {
+        T t;
+        is.read(reinterpret_cast<char *>(&t), sizeof(T));
+        return t;
+    }
+};
+
+template <>
+struct iom_serializer<std::string> {
+    static void write(std::ostream &os, std::string const &s) {
+        std::uint64_t length = s.size();
+        os.write(reinterpret_cast<char const *>(&length), sizeof(length));
+        os.write(s.data(), s.size());
+    }
+
+    static std::string read(std::istream &is) {
+        std::uint64_t length = 0;
+        is.read(reinterpret_cast<char *>(&length), sizeof(length));
+        if(!is) throw serialization_error();
+
+        // The length comes from the stream, so the string only grows as
+        // its bytes actually arrive.
+        std::string s;
+        while(s.size() < length) {
+            size_t done = s.size();
+            s.resize(done + std::min<std::uint64_t>(length - done, 65536));
+            is.read(&s[done], s.size() - done);
+            if(!is) throw serialization_error();
+        }
+        return s;
+    }
+};
+
+/*
+ * Default Hash of insertion_ordered_map. The index mixes whatever hash it is
+ * given, so strided keys do not cluster even with std::hash, but the mixing
+ * is fixed, so anyone choosing the keys can still make their slots
+ * collide. iom_hash mixes every bit of the key and is keyed by a seed drawn
+ * once per process, so colliding keys cannot be computed in advance. The
+ * order of a map does not depend on the hash, so neither does anything but
+ * the speed of lookups.
+ *
+ * Integers, enums and pointers are mixed directly, strings are hashed 8
+ * bytes at a time and other types get std::hash mixed with the seed.
+ */
+inline std::uint64_t iom_hash_seed() noexcept {
+    static std::uint64_t const seed = [] {
+        std::uint64_t entropy = static_cast<std::uint64_t>(
+                std::chrono::steady_clock::now().time_since_epoch().count());
+        entropy ^= reinterpret_cast<std::uintptr_t>(&entropy);
+        try {
+            std::random_device device;
+            entropy ^= (std::uint64_t(device()) << 32) | device();
+        } catch(...) {
+            // the clock and the stack address still vary between processes
+        }
+        return entropy;
+    }();
+
+    return seed;
+}
+
+// Folds the 128-bit product of a and b into 64 bits.
+inline std::uint64_t iom_hash_mix(std::uint64_t a, std::uint64_t b) noexcept {
+#if defined(__SIZEOF_INT128__)
+    __extension__ using product_type = unsigned __int128;
+    product_type product = static_cast<product_type>(a) * b;
+    return static_cast<std::uint64_t>(product) ^ static_cast<std::uint64_t>(product >> 64);
+#else
+    std::uint64_t a_low = a & 0xffffffff, a_high = a >> 32;
+    std::uint64_t b_low = b & 0xffffffff, b_high = b >> 32;
+    std::uint64_t low = a_low * b_low, middle1 = a_high * b_low, middle2 = a_low * b_high;
+    std::uint64_t high = a_high * b_high + (middle1 >> 32) + (middle2 >> 32);
+    std::uint64_t middle = (low >> 32) + (middle1 & 0xffffffff) + (middle2 & 0xffffffff);
+    high += middle >> 32;
+    return ((middle << 32) | (low & 0xffffffff)) ^ high;
+#endif
+}
+
+inline std::uint64_t iom_hash_word(unsigned char const *p) noexcept {
+    std::uint64_t word;
+    std::memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+inline std::uint64_t iom_hash_half_word(unsigned char const *p) noexcept {
+    std::uint32_t half;
+    std::memcpy(&half, p, sizeof(half));
+    return half;
+}
+
+// Hashes a single word; both factors depend on all of its bits. One fold
+// leaves the low bits of strided words such as i << 32 clustered, so the
+// result is folded a second time.
+inline std::uint64_t iom_hash_bits(std::uint64_t bits, std::uint64_t seed) noexcept {
+    std::uint64_t folded = iom_hash_mix(bits ^ seed ^ 0xa0761d6478bd642fULL,
+                                        ((bits << 32) | (bits >> 32)) ^ 0xe7037ed1a0b428dbULL);
+    return iom_hash_mix(folded ^ seed, 0x8ebc6af09c88c6e3ULL);
+}
+
+/*
+ * Hashes length bytes at data. Longer inputs are consumed 48 bytes at a time
+ * by three independent multiply chains, which the processor overlaps.
+ */
+inline std::uint64_t iom_hash_bytes(void const *data, size_t length, std::uint64_t seed) noexcept {
+    static constexpr std::uint64_t k0 = 0xa0761d6478bd642fULL;
+    static constexpr std::uint64_t k1 = 0xe7037ed1a0b428dbULL;
+    static constexpr std::uint64_t k2 = 0x8ebc6af09c88c6e3ULL;
+    static constexpr std::uint64_t k3 = 0x589965cc75374cc3ULL;
+
+    unsigned char const *p = static_cast<unsigned char const *>(data);
+    std::uint64_t a = 0, b = 0;
+    seed ^= iom_hash_mix(seed ^ k0, k1);
+
+    if(length <= 16) {
+        if(length >= 4) {
+            size_t middle = (length >> 3) << 2;
+            a = (iom_hash_half_word(p) << 32) | iom_hash_half_word(p + middle);
+            b = (iom_hash_half_word(p + length - 4) << 32) | iom_hash_half_word(p + length - 4 - middle);
+        } else if(length > 0) {
+            a = (std::uint64_t(p[0]) << 16) | (std::uint64_t(p[length >> 1]) << 8) | p[length - 1];
+        }
+    } else {
+        size_t left = length;
+        if(left > 48) {
+            std::uint64_t seed1 = seed, seed2 = seed;
+            do {
+                seed = iom_hash_mix(iom_hash_word(p) ^ k1, iom_hash_word(p + 8) ^ seed);
+                seed1 = iom_hash_mix(iom_hash_word(p + 16) ^ k2, iom_hash_word(p + 24) ^ seed1);
+                seed2 = iom_hash_mix(iom_hash_word(p + 32) ^ k3, iom_hash_word(p + 40) ^ seed2);
+                p += 48;
+                left -= 48;
+            } while(left > 48);
+            seed ^= seed1 ^ seed2;
+        }
+        while(left > 16) {
+            seed = iom_hash_mix(iom_hash_word(p) ^ k1, iom_hash_word(p + 8) ^ seed);
+            p += 16;
+            left -= 16;
+        }
+        a = iom_hash_word(p + left - 16);
+        b = iom_hash_word(p + left - 8);
+    }
+
+    return iom_hash_mix(k1 ^ length, iom_hash_mix(a ^ k1, b ^ seed));
+}
+
+template <class T, class Enable = void>
+struct iom_hash {
+    size_t operator()(T const &t) const noexcept(noexcept(std::hash<T>()(t))) {
+        return iom_hash_bits(std::hash<T>()(t), iom_hash_seed());
+    }
+};
+
+template <class T>
+struct iom_hash<T, std::enable_if_t<std::is_integral<T>::value || std::is_enum<T>::value
+                                    || std::is_pointer<T>::value>> {
+    size_t operator()(T const &t) const noexcept {
+        std::uint64_t bits;
+        if constexpr(std::is_pointer<T>::value)
+            bits = reinterpret_cast<std::uintptr_t>(t);
+        else
+            bits = static_cast<std::uint64_t>(t);
+
+        return iom_hash_bits(bits, iom_hash_seed());
+    }
+};
+
+template <>
+struct iom_hash<std::string_view> {
+    size_t operator()(std::string_view s) const noexcept {
+        return iom_hash_bytes(s.data(), s.size(), iom_hash_seed());
+    }
+};
+
+template <>
+struct iom_hash<std::string> {
+    size_t operator()(std::string const &s) const noexcept {
+        return iom_hash_bytes(s.data(), s.size(), iom_hash_seed());
+    }
+};
+
+/*
+ * Destroys retired map data on a background thread, so that dropping the
+ * last handle to a large map does not stall the calling thread.
+ */
+class iom_reclaimer {
+private:
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::vector<std::shared_ptr<void const>> retired;
+    bool stopping;
+    std::thread worker;
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while(true) {
+            wakeup.wait(lock, [this] { return stopping || !retired.empty(); });
+            if(retired.empty()) return;
+
+            std::vector<std::shared_ptr<void const>> batch;
+            batch.swap(retired);
+
+            lock.unlock();
+            batch.clear();
+            lock.lock();
+        }
+    }
+
+public:
+    iom_reclaimer() :
+            mutex(),
+            wakeup(),
+            retired(),
+            stopping(false),
+            worker(&iom_reclaimer::run, this) {}
+
+    iom_reclaimer(iom_reclaimer const &) = delete;
+
+    ~iom_reclaimer() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wakeup.notify_one();
+        worker.join();
+    }
+
+    static iom_reclaimer &instance() {
+        static iom_reclaimer reclaimer;
+        return reclaimer;
+    }
+
+    void retire(std::shared_ptr<void const> data) {
+        if(data == nullptr) return;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            retired.push_back(std::move(data));
+        }
+        wakeup.notify_one();
+    }
+};
+
+/*
+ * Runs checkpoints of maps on a background thread, one at a time and in the
+ * order they were submitted. Checkpoints still pending when the program
+ * exits are completed first.
+ */
+class iom_checkpointer {
+private:
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::vector<std::packaged_task<void()>> pending;
+    bool stopping;
+    std::thread worker;
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while(true) {
+            wakeup.wait(lock, [this] { return stopping || !pending.empty(); });
+            if(pending.empty()) return;
+
+            std::vector<std::packaged_task<void()>> batch;
+            batch.swap(pending);
+
+            lock.unlock();
+            for(auto &task: batch)
+                task();
+            batch.clear();
+            lock.lock();
+        }
+    }
+
+public:
+    iom_checkpointer() :
+            mutex(),
+            wakeup(),
+            pending(),
+            stopping(false),
+            worker(&iom_checkpointer::run, this) {}
+
+    iom_checkpointer(iom_checkpointer const &) = delete;
+
+    ~iom_checkpointer() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wakeup.notify_one();
+        worker.join();
+    }
+
+    static iom_checkpointer &instance() {
+        static iom_checkpointer checkpointer;
+        return checkpointer;
+    }
+
+    // The future rethrows what the task threw.
+    template <class Task>
+    std::future<void> submit(Task task) {
+        std::packaged_task<void()> packaged(std::move(task));
+        std::future<void> done = packaged.get_future();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.push_back(std::move(packaged));
+        }
+        wakeup.notify_one();
+        return done;
+    }
+};
+
+template <class K, class V, class Hash = iom_hash<K>>
 class insertion_ordered_map {
 
 private:
     class map_structure;
-    std::shared_ptr<map_structure> map;
+    map_structure map;
 
 public:
+    using iterator = typename map_structure::iterator;
+    class cursor;
 
     insertion_ordered_map() :
-            map(std::make_shared<map_structure>()) {}
+            map() {}
 
     insertion_ordered_map(insertion_ordered_map const &other) :
-            map(std::make_shared<map_structure>(*(other.map))) {}
+            map(other.map) {}
 
     insertion_ordered_map(insertion_ordered_map &&other) :
-            map(other.map)
-    {
-        other.map = nullptr;
-    }
+            map(std::move(other.map)) {}
 
     insertion_ordered_map &operator=(insertion_ordered_map other) {
-        // points to the very same structure
-        map = other.map;
+        // takes over the structure shared with the copy
+        map = std::move(other.map);
 
         return *this;
     }
 
     bool insert(K const &k, V const &v) {
-        return map->insert(k, v).second;
+        return map.insert(k, v);
     }
 
     void erase(K const &k) {
-        map->erase(k);
+        map.erase(k);
+    }
+
+    /*
+     * Move k to the back or to the front of the insertion order, keeping its
+     * value; throw lookup_error if k is absent. A reference to the value of
+     * k given out by at() or operator[] stays valid, see at(), but one given
+     * out by the const at() of a map past its inline capacity does not.
+     */
+    void move_to_back(K const &k) {
+        map.move_to_back(k);
+    }
+
+    void move_to_front(K const &k) {
+        map.move_to_front(k);
+    }
+
+    /*
+     * Bulk erasure: sharing is checked once for the whole batch and the
+     * entries are unlinked together. erase(first, last) takes iterators of
+     * this map; erase_prefix and erase_if return the number of entries
+     * erased, and erase_if erases nothing if pred throws.
+     */
+    void erase(iterator first, iterator last) {
+        map.erase(first, last);
+    }
+
+    size_t erase_prefix(size_t n) {
+        return map.erase_prefix(n);
+    }
+
+    // pred(key, value) selects the entries to erase.
+    template <class Pred>
+    size_t erase_if(Pred pred) {
+        return map.erase_if(pred);
+    }
+
+    // Erases the oldest entry; throws lookup_error if the map is empty.
+    void pop_front() {
+        map.pop_front();
     }
 
     void merge(insertion_ordered_map const &other) {
         if(&other == this) return;
 
-        map->merge(*(other.map));
+        map.merge(other.map);
     }
 
+    /*
+     * A reference given out by at() or operator[] stays valid until its key
+     * is erased. A small map keeps its entries inline, and moves them out
+     * of line first; a reference given out by the const at() of a small map
+     * stays valid until the map grows past its inline capacity or is moved.
+     */
     V &at(K const &k) {
-        return map->at(k);
+        return map.at(k);
     }
 
     V const &at(K const &k) const {
-        return map->at(k);
+        return map.at(k);
     }
 
     V &operator[](K const &k) {
-        return (*map)[k];
+        return map[k];
+    }
+
+    /*
+     * Apply fn to the value of k in place. No reference is given out, so
+     * unlike after at() or operator[], copies of the map stay cheap. update
+     * throws lookup_error if k is absent; upsert then inserts make() at the
+     * back instead of calling fn, and returns whether it did. Neither moves
+     * a present key. fn must not modify the map; if it throws, the value is
+     * left as fn left it.
+     */
+    template <class F>
+    void update(K const &k, F fn) {
+        map.update(k, fn);
+    }
+
+    template <class Make, class F>
+    bool upsert(K const &k, Make make, F fn) {
+        return map.upsert(k, make, fn);
+    }
+
+    // Transactions //
+
+    class transaction;
+
+    /*
+     * Runs f(transaction &) and keeps the changes it made through the
+     * transaction unless it throws or calls abort(); returns whether they
+     * were kept. Changes are made in place and recorded in an undo log, so
+     * a batch costs in proportion to its changes rather than to the size of
+     * the map. While f runs, the map must only be changed through the
+     * transaction, and a copy of it is made in full. Undoing cannot fail:
+     * keys and values have to be nothrow movable, and hashing and comparing
+     * keys must not throw.
+     */
+    template <class F>
+    bool batch(F f) {
+        transaction changes(map);
+        try {
+            f(changes);
+        }
+        catch (...) {
+            changes.roll_back();
+            throw;
+        }
+
+        if(changes.aborted) {
+            changes.roll_back();
+            return false;
+        }
+        changes.commit();
+        return true;
     }
 
     size_t size() const noexcept {
-        return map->size();
+        return map.size();
     }
 
     bool empty() const noexcept {
@@ -74,267 +521,3271 @@ public:
     }
 
     void clear() {
-        map->clear();
+        map.clear();
+    }
+
+    // Like clear(), but the old contents are destroyed by iom_reclaimer.
+    void clear_in_background() {
+        map.clear_in_background();
     }
 
     bool contains(K const &k) const {
-        return map->contains(k);
+        return map.contains(k);
     }
 
-    // Iterators //
+    /*
+     * Copies of a map share their data. The first modification of a shared
+     * map copies only the pointers to it; pages of entries and of the index
+     * are then copied one by one as they are written. step() copies up to
+     * budget of the pages still shared ahead of time, and returns true when
+     * nothing is shared any more.
+     */
+    bool step(size_t budget) {
+        return map.step(budget);
+    }
 
-    using iterator = typename map_structure::iterator;
+    // Serialization //
 
-    iterator begin() const {
-        return map->begin();
+    /*
+     * Writes the entries in insertion order. The format is a header of
+     * 64-bit words: magic, format version, sizeof(K), sizeof(V) and entry
+     * count; then each key followed by its value, copied bytewise if both
+     * are trivially copyable and encoded by iom_serializer otherwise. load()
+     * rejects a stream whose header does not match the map.
+     */
+    void save(std::ostream &os) const {
+        map.save(os);
     }
 
-    iterator end() const {
-        return map->end();
+    // Replaces the contents of the map; strong guarantee.
+    void load(std::istream &is) {
+        map.load(is);
     }
-};
 
+    void save(std::string const &path) const {
+        std::ofstream os(path, std::ios::binary | std::ios::trunc);
+        if(!os) throw serialization_error();
 
-template <class K, class V, class Hash>
-class insertion_ordered_map<K, V, Hash>::map_structure {
-private:
-    struct structure;
-    using map_iterator = typename structure::maptype::iterator;
-    using insertions_iterator = typename structure::keylisttype::iterator;
-    using insertions_const_iterator = typename structure::keylisttype::const_iterator;
+        save(os);
+        os.flush();
+        if(!os) throw serialization_error();
+    }
 
-    std::shared_ptr<structure> data;
+    void load(std::string const &path) {
+        std::ifstream is(path, std::ios::binary);
+        if(!is) throw serialization_error();
 
-    void copy() { // strong
-        data = std::make_shared<structure>(*data);
+        load(is);
     }
 
-    void copy_on_write() { // strong
-        if(data.use_count() > 1)
-            copy();
+    /*
+     * Saves the current contents to path on the iom_checkpointer thread.
+     * The map is only shared with the snapshot being written, so it can be
+     * modified meanwhile: its first modification copies pointers to pages,
+     * not entries. The file is written as path + ".partial" and renamed
+     * when complete, so path always holds a whole checkpoint. The future
+     * throws serialization_error if writing fails.
+     */
+    std::future<void> checkpoint_async(std::string const &path) const {
+        return iom_checkpointer::instance().submit([snapshot = *this, path] {
+            std::string partial = path + ".partial";
+            snapshot.save(partial);
+
+            if(std::rename(partial.c_str(), path.c_str()) != 0)
+                throw serialization_error();
+        });
     }
 
-public:
+    // Iterators //
 
-    // Iterator //
-    class iterator {
-    private:
-        using pointer = std::shared_ptr<map_structure const>;
-        using pair_type = std::pair<K const&, V const&>;
+    iterator begin() const {
+        return map.begin();
+    }
+
+    iterator end() const {
+        return map.end();
+    }
 
-        insertions_const_iterator iter;
-        const pointer ptr;
+    // Positional access //
 
-    public:
+    // The entry at position i of the insertion order, or end() if i >= size().
+    iterator nth(size_t i) const {
+        return map.nth(i);
+    }
 
-        iterator(const iterator& other) :
-            iter(other.iter),
-            ptr(other.ptr)
-        {}
+    // Position of k in the insertion order; throws lookup_error if absent.
+    size_t position_of(K const &k) const {
+        return map.position_of(k);
+    }
 
-        iterator(insertions_const_iterator it, const map_structure* const iterated) :
-            iter(it),
-            ptr(iterated)
-        {}
+    // Key order //
 
-        iterator operator++() {
-            iter++;
-            return *this;
-        }
+    class ordered_view;
 
-        const pair_type operator*() const {
-            return make_pair(*iter, ptr->at(*iter));
-        }
+    /*
+     * The entries ordered by key, which has to be less-than comparable. The
+     * map keeps copies of its keys in that order, with where their entries
+     * are, and no copies of values. They are sorted on the first call, and
+     * on later calls the entries inserted or moved since are merged in, so
+     * a call costs about as much as the changes since the last one, rather
+     * than a sort; that is why this is not const. Erased keys are cleared
+     * out as they accumulate. Compaction, and undoing a batch, renumber
+     * entries, after which the keys are sorted again.
+     */
+    ordered_view by_key() {
+        map.sort_keys();
+        return ordered_view(map);
+    }
 
-        bool operator==(const iterator& rhs) const { return iter == rhs.iter; }
-        bool operator!=(const iterator& rhs) const { return iter != rhs.iter; }
+    // Differences //
 
-        const std::unique_ptr<pair_type> operator->() const {
-            return std::make_unique<pair_type>(*iter, ptr->at(*iter));
-        }
+    /*
+     * What changed from one version of a map to another. Erased keys are
+     * listed in the order of the old version, the others in the order of
+     * the new one. Reordered keys are present in both but were moved
+     * relative to the rest; a key may be both reordered and changed.
+     */
+    struct changes {
+        std::vector<K> inserted;
+        std::vector<K> erased;
+        std::vector<K> changed;
+        std::vector<K> reordered;
     };
 
-    iterator begin() const {
-        auto it = data->insertions.begin();
-        return iterator(it, this);
+    /*
+     * When one version is a modified copy of the other, only the pages of
+     * entries written since the copy are compared, so the cost follows the
+     * number of changes rather than the size of the map. Otherwise every
+     * entry is compared. V has to be equality comparable.
+     */
+    static changes diff(insertion_ordered_map const &from, insertion_ordered_map const &to) {
+        changes result;
+        map_structure::diff(from.map, to.map, result);
+        return result;
     }
 
-    iterator end() const {
-        auto it = data->insertions.end();
-        return iterator(it, this);
+    // Set algebra //
+
+    /*
+     * intersect and difference return the entries of a whose keys are, or
+     * are not, in b, in the order of a. unite returns a followed by the
+     * entries of b whose keys are not in a, in the order of b. Keys of the
+     * smaller map are looked up in the larger one where the order allows,
+     * in batches and, when Hash is stateless, with the hashes cached in the
+     * index. A result that keeps most of a shares its pages; maps sharing
+     * their data are not looked into at all.
+     */
+    static insertion_ordered_map intersect(insertion_ordered_map const &a, insertion_ordered_map const &b) {
+        insertion_ordered_map result;
+        map_structure::intersect(a.map, b.map, result.map);
+        return result;
     }
-    //
 
-    map_structure() :
-            data(std::make_shared<structure>()) {}
+    static insertion_ordered_map difference(insertion_ordered_map const &a, insertion_ordered_map const &b) {
+        insertion_ordered_map result;
+        map_structure::difference(a.map, b.map, result.map);
+        return result;
+    }
 
-    map_structure(map_structure const &other) :
-            data(other.data)
-    {
-        if(!data->non_const_refs_given.empty())
-            copy();
+    // Not named union, which is a keyword.
+    static insertion_ordered_map unite(insertion_ordered_map const &a, insertion_ordered_map const &b) {
+        insertion_ordered_map result;
+        map_structure::unite(a.map, b.map, result.map);
+        return result;
     }
+};
 
-    std::pair<map_iterator, bool> insert(K const &k, V const &v) {
-        copy_on_write();
 
-        insertions_iterator iter = data->insertions.insert(data->insertions.end(), k);
+template <class K, class V, class Hash>
+class insertion_ordered_map<K, V, Hash>::map_structure {
+private:
+    struct structure;
+    using small_entry = std::pair<K, V>;
 
-        try {
-            std::pair<map_iterator, bool> insertion_result =
-                    data->mappings.insert({k, structure::mapValue(iter, v)});
+    /*
+     * Maps of up to small_capacity entries keep them inline, in the bytes
+     * that hold data once the map grows past that, and look keys up
+     * linearly. Constructing or copying a small map does not allocate. Up
+     * to 8 entries are kept inline, fewer if the map would then take more
+     * than small_bytes, a cache line; each entry also takes a byte of
+     * small_order, and the map two bytes of counts.
+     *
+     * An inline entry stays in its cell until it is erased: small_order
+     * lists the cells in insertion order, and reordering or erasing entries
+     * only rearranges it. Inline values are never given out by non-const
+     * reference, see at().
+     */
+    static constexpr size_t small_bytes = 64;
+    static constexpr size_t small_capacity = std::min<size_t>(8, (small_bytes - 2) / (sizeof(small_entry) + 1));
+    static constexpr unsigned char large = 0xff;   // small_size while data is in use
+
+    union {
+        std::shared_ptr<structure> data;
+        alignas(small_entry) unsigned char small_storage[
+                std::max<size_t>(1, small_capacity * sizeof(small_entry))];
+    };
+    unsigned char small_size;
+    unsigned char small_cells;      // bit c is set while cell c holds an entry
+    unsigned char small_order[std::max<size_t>(1, small_capacity)];
 
-            if(insertion_result.second == false) {
-                data->insertions.erase(insertion_result.first->second.iter);
-                insertion_result.first->second.iter = iter;
-            }
+    void copy() { // strong
+        data = std::make_shared<structure>(*data);
+    }
 
-            return insertion_result;
-        }
-        catch (...) {
-            data->insertions.erase(iter);
-            throw;
-        }
+    void copy_on_write() { // strong
+        if(data.use_count() > 1)
+            copy();
     }
 
-    void erase(K const &k) {
-        if(contains(k) == false) throw lookup_error();
-        copy_on_write();                                // doesn't modify the logical state
+    bool is_small() const noexcept {
+        return small_size != large;
+    }
 
-        map_iterator iter = data->mappings.find(k);    // doesn't modify the logical state
-        data->non_const_refs_given.erase(k);           // strong
+    // Switches to data, destroying the inline entries.
+    void become_large(std::shared_ptr<structure> grown) noexcept {
+        small_clear();
+        new (&data) std::shared_ptr<structure>(std::move(grown));
+        small_size = large;
+    }
 
-        data->insertions.erase(iter->second.iter);     // no-throw
-        data->mappings.erase(iter);                    // no-throw
+    // Lets go of data or of the inline entries, leaving an empty small map.
+    void reset() noexcept {
+        if(is_small()) {
+            small_clear();
+            return;
+        }
+        data.~shared_ptr();
+        small_size = 0;
     }
 
-    void merge(map_structure const &other) {
-        if(&other == this) return;
+    // Moves the entries or the data of other, which is left empty.
+    void take(map_structure &&other) { // strong
+        if(other.is_small())
+            small_take(std::move(other));
+        else
+            become_large(std::move(other.data));
+        other.reset();
+    }
 
-        std::shared_ptr<structure> backup_data = data;
+    small_entry *small() noexcept {
+        return std::launder(reinterpret_cast<small_entry *>(small_storage));
+    }
 
-        try {
-            copy();
+    small_entry const *small() const noexcept {
+        return std::launder(reinterpret_cast<small_entry const *>(small_storage));
+    }
 
-            for(auto k: other.data->insertions)
-                insert(k, other.at(k));
-        }
-        catch (...) {
-            data = backup_data;
-            throw;
-        }
+    // The inline entry at position i of the insertion order.
+    small_entry &small_at(size_t i) noexcept {
+        return small()[small_order[i]];
     }
 
-    V &at(K const &k) {
-        if(contains(k) == false) throw lookup_error();
-        copy_on_write();
+    small_entry const &small_at(size_t i) const noexcept {
+        return small()[small_order[i]];
+    }
 
-        auto insertion_result = data->non_const_refs_given.insert(k);
+    size_t small_find(K const &k) const {
+        size_t i = 0;
+        while(i < small_size && !(small_at(i).first == k))
+            i++;
+        return i;
+    }
 
-        try {
-            return data->mappings.at(k).value;
-        }
-        catch (...) {
-            if(insertion_result.second == true) {
-                data->non_const_refs_given.erase(insertion_result.first);
-            }
-            throw;
-        }
+    // Constructs an entry in a free cell, at the end of the order.
+    template <class... Args>
+    void small_push(Args &&... args) { // strong
+        unsigned char c = 0;
+        while((small_cells >> c & 1) != 0)
+            c++;
+
+        new (small() + c) small_entry(std::forward<Args>(args)...);
+        small_cells |= 1 << c;
+        small_order[small_size++] = c;
     }
 
-    V const &at(K const &k) const {
-        if(contains(k) == false) throw lookup_error();
+    // Destroys the entry at position i.
+    void small_remove(size_t i) noexcept {
+        unsigned char c = small_order[i];
 
-        return data->mappings.at(k).value;
+        small()[c].~small_entry();
+        small_cells &= ~(1 << c);
+        std::copy(small_order + i + 1, small_order + small_size, small_order + i);
+        small_size--;
     }
 
-    V &operator[](K const &k) {
-        auto insertion_result = insert(k, V());
+    void small_clear() noexcept {
+        while(small_size > 0)
+            small_remove(small_size - 1);
+    }
 
+    // Copies or moves the inline entries of other, depending on its category.
+    template <class Other>
+    void small_take(Other &&other) { // strong
+        using source = std::conditional_t<std::is_lvalue_reference<Other>::value,
+                                          small_entry const &, small_entry &&>;
         try {
-            return at(k);
+            while(small_size < other.small_size)
+                small_push(static_cast<source>(other.small_at(small_size)));
         }
         catch (...) {
-            if(insertion_result.second == true) {
-                data->mappings.erase(insertion_result.first);
-                data->insertions.pop_back();
-            }
+            small_clear();
             throw;
         }
     }
 
-    size_t size() const noexcept {
-        return data->insertions.size();
-    }
+    void promote() { // strong
+        std::shared_ptr<structure> grown = std::make_shared<structure>();
+        grown->reserve(2 * small_capacity);
 
-    void clear() {
-        copy_on_write();                    // strong
+        for(size_t i = 0; i < small_size; i++)
+            grown->append(small_at(i).first, small_at(i).second);
 
-        data->mappings.clear();             // no-throw
-        data->insertions.clear();           // no-throw
-        data->non_const_refs_given.clear(); // no-throw
+        become_large(std::move(grown));
     }
 
-    bool contains(K const &k) const {
-        return data->mappings.count(k) > 0;
+    // For maps under construction: no copy-on-write, duplicates rejected.
+    bool append(K const &k, V const &v) { // strong
+        if(is_small()) {
+            if(small_find(k) < small_size) return false;
+            if(small_size == small_capacity)
+                promote();
+        }
+        if(!is_small())
+            return data->append(k, v);
+
+        small_push(k, v);
+        return true;
     }
 
+    void pop_back() {
+        if(is_small()) {
+            small_remove(small_size - 1);
+            return;
+        }
 
-};
+        size_t slot = data->find_slot(data->key(data->used - 1));
 
-template <class K, class V, class Hash>
-struct insertion_ordered_map<K, V, Hash>::map_structure::structure {
-    using keylisttype = std::list<const K>;
+        data->prepare_erase(slot);      // may copy the page of the key
+        data->non_const_refs_given.erase(data->key(data->used - 1));
+        data->erase_slot(slot);
+    }
 
-    struct mapvaluetype {
-        typename keylisttype::iterator iter;
-        V value;
+    template <class F>
+    void for_each(F f) const {
+        if(is_small()) {
+            for(size_t i = 0; i < small_size; i++)
+                f(small_at(i).first, small_at(i).second);
+        }
+        else {
+            data->for_each(f);
+        }
+    }
 
-        mapvaluetype () {}
+public:
 
-        mapvaluetype(mapvaluetype const &other) :
-                iter(other.iter),
-                value(other.value) {}
+    // Iterator //
+    class iterator {
+    private:
+        friend class map_structure;
 
-        mapvaluetype(typename keylisttype::iterator iter, V value) :
-                iter(iter),
-                value(value) {}
-    };
+        using pointer = map_structure const *;
+        using pair_type = std::pair<K const&, V const&>;
 
-    using maptype = std::unordered_map<K, mapvaluetype, Hash>;
-    using keysettype = std::unordered_set<K, Hash>;
+        // index of the inline entry, or entry number in the structure
+        size_t position;
+        pointer ptr;
 
-    /*
-     * As per cppreference.com:
-     * If an insertion occurs and results in a rehashing of the container,
-     * all iterators are invalidated. Otherwise iterators are not affected.
-     * References are not invalidated. Rehashing occurs only if the new
-     * number of elements is greater than max_load_factor()*bucket_count().
-     */
+        pair_type get() const {
+            if(ptr->is_small())
+                return pair_type(ptr->small_at(position).first, ptr->small_at(position).second);
 
-    maptype mappings;
-    keylisttype insertions;
-    keysettype non_const_refs_given;
+            return pair_type(ptr->data->key(position), ptr->data->value(position));
+        }
+
+    public:
+
+        iterator(const iterator& other) :
+            position(other.position),
+            ptr(other.ptr)
+        {}
+
+        iterator(size_t position, const map_structure* const iterated) :
+            position(position),
+            ptr(iterated)
+        {}
+
+        iterator operator++() {
+            if(ptr->is_small())
+                position++;
+            else
+                position = ptr->data->next(position + 1);
+            return *this;
+        }
+
+        const pair_type operator*() const {
+            return get();
+        }
+
+        bool operator==(const iterator& rhs) const { return position == rhs.position; }
+        bool operator!=(const iterator& rhs) const { return position != rhs.position; }
+
+        const std::unique_ptr<pair_type> operator->() const {
+            return std::make_unique<pair_type>(get());
+        }
+    };
+
+    iterator begin() const {
+        if(is_small())
+            return iterator(0, this);
+
+        return iterator(data->first(), this);
+    }
+
+    iterator end() const {
+        if(is_small())
+            return iterator(small_size, this);
+
+        return iterator(data->used, this);
+    }
+
+    iterator nth(size_t i) const {
+        if(i >= size())
+            return end();
+        if(is_small())
+            return iterator(i, this);
+
+        return iterator(data->nth(i), this);
+    }
+    //
+
+    size_t position_of(K const &k) const {
+        if(is_small()) {
+            size_t i = small_find(k);
+            if(i == small_size) throw lookup_error();
+
+            return i;
+        }
+
+        size_t slot = data->find_slot(k);
+        if(data->slot_at(slot).entry == 0) throw lookup_error();
+
+        return data->position(data->slot_at(slot).entry - 1);
+    }
+
+    // Marks the members of a longest increasing subsequence of distinct values.
+    static std::vector<bool> longest_increasing(std::vector<size_t> const &values) {
+        static constexpr size_t none = ~size_t(0);
+
+        std::vector<size_t> tails;      // last index of the best run of each length
+        std::vector<size_t> previous(values.size());
+
+        for(size_t i = 0; i < values.size(); i++) {
+            auto it = std::lower_bound(tails.begin(), tails.end(), values[i],
+                                       [&values](size_t j, size_t value) {
+                                           return values[j] < value;
+                                       });
+
+            previous[i] = it == tails.begin() ? none : *(it - 1);
+            if(it == tails.end())
+                tails.push_back(i);
+            else
+                *it = i;
+        }
+
+        std::vector<bool> members(values.size(), false);
+        for(size_t i = tails.empty() ? none : tails.back(); i != none; i = previous[i])
+            members[i] = true;
+        return members;
+    }
+
+    /*
+     * Versions that number entries alike, as they share pages, are compared
+     * page by page. Otherwise the keys of to found in from are reordered
+     * unless they form the longest run in the order of from.
+     */
+    static void diff(map_structure const &from, map_structure const &to, changes &result) {
+        if(from.shares_data_with(to)) return;
+
+        if(!from.is_small() && !to.is_small() && structure::numbered_alike(*from.data, *to.data)) {
+            structure::diff_pages(*from.data, *to.data, result);
+            return;
+        }
+
+        std::vector<K const *> kept;
+        std::vector<size_t> positions;
+
+        to.for_each([&](K const &k, V const &v) {
+            if(!from.contains(k)) {
+                result.inserted.push_back(k);
+                return;
+            }
+
+            if(!(from.at(k) == v))
+                result.changed.push_back(k);
+            kept.push_back(&k);
+            positions.push_back(from.position_of(k));
+        });
+
+        from.for_each([&](K const &k, V const &) {
+            if(!to.contains(k))
+                result.erased.push_back(k);
+        });
+
+        std::vector<bool> in_order = longest_increasing(positions);
+        for(size_t i = 0; i < kept.size(); i++) {
+            if(!in_order[i])
+                result.reordered.push_back(*kept[i]);
+        }
+    }
+
+    // Set algebra //
+
+    bool shares_data_with(map_structure const &other) const noexcept {
+        return &other == this || (!is_small() && !other.is_small() && data == other.data);
+    }
+
+    /*
+     * The numbers of the entries of this large map whose keys are in other,
+     * in increasing order. The keys of the smaller map are looked up in the
+     * larger one.
+     */
+    std::vector<size_t> common_with(map_structure const &other) const {
+        std::vector<size_t> common;
+
+        if(other.is_small()) {
+            other.for_each([this, &common](K const &k, V const &) {
+                size_t n = data->number_of(k);
+                if(n != data->used)
+                    common.push_back(n);
+            });
+        }
+        else if(data->live <= other.data->live) {
+            size_t absent = other.data->used;
+            data->probe(*other.data, [&common, absent](size_t n, size_t m) {
+                if(m != absent)
+                    common.push_back(n);
+            });
+        }
+        else {
+            size_t absent = data->used;
+            other.data->probe(*data, [&common, absent](size_t, size_t n) {
+                if(n != absent)
+                    common.push_back(n);
+            });
+        }
+
+        std::sort(common.begin(), common.end());
+        return common;
+    }
+
+    // The numbers of the other live entries of this large map, in order.
+    std::vector<size_t> complement_of(std::vector<size_t> const &numbers) const {
+        std::vector<size_t> complement;
+        complement.reserve(size() - numbers.size());
+
+        auto listed = numbers.begin();
+        data->for_each_numbered([&complement, &listed, &numbers](size_t n, K const &, V const &) {
+            if(listed != numbers.end() && *listed == n)
+                ++listed;
+            else
+                complement.push_back(n);
+        });
+        return complement;
+    }
+
+    /*
+     * result gets the listed entries of this large map, in order. When they
+     * are most of it, it is copied, which shares its pages, and the rest is
+     * erased from the copy; otherwise they are inserted one by one.
+     */
+    void extract(std::vector<size_t> const &numbers, map_structure &result) const {
+        if(2 * numbers.size() <= size()) {
+            for(size_t n: numbers)
+                result.insert(data->key(n), data->value(n));
+            return;
+        }
+
+        std::vector<size_t> doomed = complement_of(numbers);
+        result = map_structure(*this);
+        if(doomed.empty()) return;
+
+        result.copy_on_write();         // the copy keeps entry numbers
+        result.data->erase_listed(doomed);
+    }
+
+    static void intersect(map_structure const &a, map_structure const &b, map_structure &result) {
+        if(a.shares_data_with(b)) {
+            result = map_structure(a);
+            return;
+        }
+
+        if(a.is_small()) {
+            a.for_each([&b, &result](K const &k, V const &v) {
+                if(b.contains(k))
+                    result.insert(k, v);
+            });
+            return;
+        }
+
+        a.extract(a.common_with(b), result);
+    }
+
+    static void difference(map_structure const &a, map_structure const &b, map_structure &result) {
+        if(a.shares_data_with(b)) return;
+
+        if(a.is_small()) {
+            a.for_each([&b, &result](K const &k, V const &v) {
+                if(!b.contains(k))
+                    result.insert(k, v);
+            });
+            return;
+        }
+
+        a.extract(a.complement_of(a.common_with(b)), result);
+    }
+
+    static void unite(map_structure const &a, map_structure const &b, map_structure &result) {
+        result = map_structure(a);
+        if(a.shares_data_with(b)) return;
+
+        if(a.is_small() || b.is_small()) {
+            b.for_each([&a, &result](K const &k, V const &v) {
+                if(!a.contains(k))
+                    result.insert(k, v);
+            });
+            return;
+        }
+
+        std::vector<size_t> added;
+        size_t absent = a.data->used;
+        b.data->probe(*a.data, [&added, absent](size_t n, size_t m) {
+            if(m == absent)
+                added.push_back(n);
+        });
+        std::sort(added.begin(), added.end());
+
+        for(size_t n: added)
+            result.insert(b.data->key(n), b.data->value(n));
+    }
+
+    // Key order //
+
+    class key_iterator {
+    private:
+        friend class map_structure;
+
+        using pair_type = std::pair<K const&, V const&>;
+
+        // null for an empty map, whose begin and end are both 0, 0
+        structure const *ptr;
+        size_t chunk;
+        size_t item;
+
+        key_iterator(structure const *ordered, size_t chunk, size_t item) :
+            ptr(ordered),
+            chunk(chunk),
+            item(item)
+        {
+            if(ptr != nullptr)
+                ptr->skip_stale(this->chunk, this->item);
+        }
+
+        pair_type get() const {
+            size_t n = (*ptr->by_key->chunks[chunk])[item].entry;
+            return pair_type(ptr->key(n), ptr->value(n));
+        }
+
+    public:
+
+        key_iterator operator++() {
+            ptr->skip_stale(chunk, ++item);
+            return *this;
+        }
+
+        const pair_type operator*() const {
+            return get();
+        }
+
+        bool operator==(const key_iterator& rhs) const { return chunk == rhs.chunk && item == rhs.item; }
+        bool operator!=(const key_iterator& rhs) const { return !(*this == rhs); }
+
+        const std::unique_ptr<pair_type> operator->() const {
+            return std::make_unique<pair_type>(get());
+        }
+    };
+
+    // Brings the key order of the structure up to date; inline entries have
+    // none, see ordered_view.
+    void sort_keys() { // strong
+        if(is_small() || data->keys_sorted()) return;
+
+        copy_on_write();
+        data->sort_keys();
+    }
+
+    // The key order has to be up to date.
+    key_iterator keys_begin() const {
+        return key_iterator(is_small() ? nullptr : data.get(), 0, 0);
+    }
+
+    key_iterator keys_end() const {
+        if(is_small()) return key_iterator(nullptr, 0, 0);
+
+        return key_iterator(data.get(), data->by_key->chunks.size(), 0);
+    }
+
+    key_iterator key_bound(K const &k, bool after) const {
+        if(is_small()) return keys_end();
+
+        std::pair<size_t, size_t> at = data->key_bound(k, after);
+        return key_iterator(data.get(), at.first, at.second);
+    }
+
+    /*
+     * Makes the entries readable by read() and returns how they are
+     * numbered. Inline entries are moved into a structure numbered 0, in
+     * which entry numbers are positions.
+     */
+    std::uint64_t pin() { // strong
+        if(is_small()) {
+            if(small_size == 0) return 0;
+
+            promote();
+            data->numbering = 0;
+        }
+        return data->numbering;
+    }
+
+    // See structure::read; returns the number of entries passed to f.
+    template <class F>
+    size_t read(std::uint64_t &position, size_t limit, F f) const {
+        if(is_small()) return 0;
+
+        size_t count = 0;
+        position = data->read(position, limit, [&count, &f](K const *keys, V const *values, size_t n) {
+            count += n;
+            f(keys, values, n);
+        });
+        return count;
+    }
+
+    map_structure() :
+            small_size(0),
+            small_cells(0) {}
+
+    map_structure(map_structure const &other) :
+            small_size(0),
+            small_cells(0)
+    {
+        if(other.is_small()) {
+            small_take(other);
+            return;
+        }
+
+        std::shared_ptr<structure> shared = other.data;
+        if(!shared->non_const_refs_given.empty() || shared->batching)
+            shared = std::make_shared<structure>(*shared);
+        become_large(std::move(shared));
+    }
+
+    map_structure(map_structure &&other) :
+            small_size(0),
+            small_cells(0)
+    {
+        take(std::move(other));
+    }
+
+    map_structure &operator=(map_structure &&other) {
+        if(&other == this) return *this;
+
+        reset();
+        take(std::move(other));
+
+        return *this;
+    }
+
+    ~map_structure() {
+        reset();
+    }
+
+    bool insert(K const &k, V const &v) {
+        if(is_small()) {
+            size_t i = small_find(k);
+            if(i < small_size) {
+                std::rotate(small_order + i, small_order + i + 1, small_order + small_size);
+                return false;
+            }
+            if(small_size < small_capacity) {
+                small_push(k, v);
+                return true;
+            }
+            promote();
+        }
+
+        copy_on_write();
+
+        return data->insert(k, v);
+    }
+
+    void erase(K const &k) {
+        if(is_small()) {
+            size_t i = small_find(k);
+            if(i == small_size) throw lookup_error();
+
+            small_remove(i);
+            return;
+        }
+
+        if(contains(k) == false) throw lookup_error();
+        copy_on_write();                            // doesn't modify the logical state
+
+        size_t slot = data->find_slot(k);           // doesn't modify the logical state
+        data->prepare_erase(slot);                  // doesn't modify the logical state
+        data->non_const_refs_given.erase(k);        // strong
+
+        data->erase_slot(slot);                     // no-throw
+    }
+
+    void move_to_back(K const &k) {
+        if(is_small()) {
+            size_t i = small_find(k);
+            if(i == small_size) throw lookup_error();
+
+            std::rotate(small_order + i, small_order + i + 1, small_order + small_size);
+            return;
+        }
+
+        size_t slot = data->find_slot(k);
+        if(data->slot_at(slot).entry == 0) throw lookup_error();
+
+        copy_on_write();                // the copy keeps slot numbers
+        data->move_to_back(slot);
+    }
+
+    void move_to_front(K const &k) {
+        if(is_small()) {
+            size_t i = small_find(k);
+            if(i == small_size) throw lookup_error();
+
+            std::rotate(small_order, small_order + i, small_order + i + 1);
+            return;
+        }
+
+        size_t slot = data->find_slot(k);
+        if(data->slot_at(slot).entry == 0) throw lookup_error();
+
+        copy_on_write();                // the copy keeps slot numbers
+        data->move_to_front(slot);
+    }
+
+    void pop_front() {
+        if(size() == 0) throw lookup_error();
+
+        if(is_small()) {
+            small_remove(0);
+            return;
+        }
+
+        copy_on_write();
+
+        size_t slot = data->find_slot(data->key(data->first()));
+        data->prepare_erase(slot);                  // doesn't modify the logical state
+
+        K const &k = data->key(data->first());
+        if(!data->non_const_refs_given.empty())
+            data->non_const_refs_given.erase(k);    // strong
+
+        data->erase_slot(slot);                     // no-throw
+    }
+
+    void erase(iterator first, iterator last) {
+        if(first == last) return;
+
+        if(is_small()) {
+            for(size_t i = last.position; i-- > first.position; )
+                small_remove(i);
+            return;
+        }
+
+        copy_on_write();                // the copy keeps entry numbers
+        data->erase_run(first.position, last.position);
+    }
+
+    size_t erase_prefix(size_t n) {
+        n = std::min(n, size());
+        erase(begin(), nth(n));
+        return n;
+    }
+
+    template <class Pred>
+    size_t erase_if(Pred pred) {
+        if(is_small()) {
+            bool doomed[std::max<size_t>(1, small_capacity)] = {};
+            for(size_t i = 0; i < small_size; i++)
+                doomed[i] = pred(static_cast<K const &>(small_at(i).first),
+                                 static_cast<V const &>(small_at(i).second));
+
+            size_t erased = 0;
+            for(size_t i = small_size; i-- > 0; ) {
+                if(doomed[i]) {
+                    small_remove(i);
+                    erased++;
+                }
+            }
+            return erased;
+        }
+
+        // pred sees the shared data; nothing is copied if it selects nothing
+        std::vector<size_t> doomed;
+        data->for_each_numbered([&doomed, &pred](size_t n, K const &k, V const &v) {
+            if(pred(k, v))
+                doomed.push_back(n);
+        });
+        if(doomed.empty()) return 0;
+
+        copy_on_write();                // the copy keeps entry numbers
+        data->erase_listed(doomed);
+        return doomed.size();
+    }
+
+    /*
+     * A large map is merged into in place, as a batch, when undoing it
+     * cannot fail; the copy made otherwise costs in proportion to the map
+     * rather than to other.
+     */
+    void merge(map_structure const &other) {
+        if(&other == this) return;
+
+        constexpr bool undoable = std::is_nothrow_move_constructible<K>::value
+                && std::is_nothrow_move_constructible<V>::value
+                && std::is_nothrow_move_assignable<V>::value
+                && noexcept(std::declval<Hash const &>()(std::declval<K const &>()))
+                && noexcept(std::declval<K const &>() == std::declval<K const &>());
+
+        if constexpr(undoable) {
+            if(!is_small()) {
+                undo_log log;
+                try {
+                    other.for_each([this, &log](K const &k, V const &v) {
+                        batch_insert(k, v, log);
+                    });
+                }
+                catch (...) {
+                    undo(log);
+                    throw;
+                }
+
+                end_batch();
+                return;
+            }
+        }
+
+        // shares data with *this, so the first insert copies it
+        map_structure merged(*this);
+
+        other.for_each([&merged](K const &k, V const &v) {
+            merged.insert(k, v);
+        });
+
+        *this = std::move(merged);
+    }
+
+    // The value is given out by reference, so it leaves inline storage,
+    // which growing or moving the map destroys.
+    V &at(K const &k) {
+        if(is_small()) {
+            if(small_find(k) == small_size) throw lookup_error();
+
+            promote();
+        }
+
+        if(contains(k) == false) throw lookup_error();
+        copy_on_write();
+
+        return data->share_value(k);
+    }
+
+    // A copy of the structure keeps the slots of the keys.
+    template <class F>
+    void update(K const &k, F &fn) {
+        if(is_small()) {
+            size_t i = small_find(k);
+            if(i == small_size) throw lookup_error();
+
+            fn(small_at(i).second);
+            return;
+        }
+
+        size_t slot = data->find_slot(k);
+        if(data->slot_at(slot).entry == 0) throw lookup_error();
+        copy_on_write();
+
+        fn(data->own_value(data->slot_at(slot).entry - 1));
+    }
+
+    template <class Make, class F>
+    bool upsert(K const &k, Make &make, F &fn) {
+        if(is_small()) {
+            size_t i = small_find(k);
+            if(i < small_size) {
+                fn(small_at(i).second);
+                return false;
+            }
+            if(small_size < small_capacity) {
+                small_push(k, make());
+                return true;
+            }
+            promote();
+        }
+
+        copy_on_write();
+
+        bool inserted = false;
+        V &value = data->find_or_append(k, make, inserted);
+        if(!inserted)
+            fn(value);
+        return inserted;
+    }
+
+    // Transactions //
+
+    /*
+     * A change made in a batch, with what undoing it needs: the number the
+     * entry of the key had before, or was given if the key was appended,
+     * the number a moved entry was given, the value an erasure or
+     * assignment replaced and, for an erased key whose value was given out
+     * by reference, the box that held it.
+     */
+    struct undo_entry {
+        enum kind_type { appended, moved, erased, assigned };
+
+        kind_type kind;
+        K key;
+        size_t number;
+        size_t moved_to;
+        std::optional<V> value;
+        typename structure::refmaptype::node_type box;
+    };
+
+    struct saved_index {
+        typename structure::slot_table slots;
+        typename structure::slot_table draining;
+        size_t migrated;
+    };
+
+    /*
+     * The changes of a batch. If the index was shared when the batch began,
+     * owning all of it would copy it whole, so the log keeps it as it was
+     * instead: undoing restores the entries and then puts it back.
+     */
+    struct undo_log {
+        std::vector<undo_entry> changes;
+        std::optional<saved_index> index;
+    };
+
+    /*
+     * Called before every logged change. Owns the structure, the pages of
+     * the changes logged so far and, unless the log keeps the index, the
+     * index, and keeps the structure from being compacted or dropping empty
+     * pages until end_batch(), so that entry numbers stay valid and undoing
+     * allocates nothing. Returns false for a small map, which is not logged
+     * but copied.
+     */
+    bool begin_batch(undo_log &log) { // strong
+        if(is_small()) return false;
+        if(data.use_count() == 1 && data->batching) return true;
+
+        copy_on_write();
+        if(log.changes.empty() && (data->slots.shared() || data->draining.shared()))
+            log.index = saved_index{data->slots, data->draining, data->migrated};
+        if(!log.index) {
+            data->slots.own_all();
+            data->draining.own_all();
+        }
+        for(auto const &change: log.changes) {
+            data->own(change.number / structure::page_size);
+
+            size_t n = data->number_of(change.key);
+            if(n < data->used)
+                data->own(n / structure::page_size);
+        }
+        data->batching = true;
+        return true;
+    }
+
+    void end_batch() noexcept {
+        if(!is_small())
+            data->batching = false;
+    }
+
+    // Makes sure that one more change can be logged without throwing.
+    static void make_room(undo_log &log) { // strong
+        if(log.changes.size() == log.changes.capacity())
+            log.changes.reserve(std::max<size_t>(16, 2 * log.changes.size()));
+    }
+
+    bool batch_insert(K const &k, V const &v, undo_log &log) { // strong
+        begin_batch(log);
+        make_room(log);
+
+        size_t n = data->number_of(k);
+        size_t used = data->used;
+        bool appended = n == used;
+        undo_entry change{appended ? undo_entry::appended : undo_entry::moved, k, n, n, std::nullopt, {}};
+
+        data->insert(k, v);
+        if(!appended && data->used != used)
+            change.moved_to = data->used - 1;
+        log.changes.push_back(std::move(change));
+        return appended;
+    }
+
+    // The box of a value given out by reference is kept in the log, so
+    // that undoing brings the value back into it.
+    void batch_erase(K const &k, undo_log &log) { // strong
+        begin_batch(log);
+        make_room(log);
+
+        size_t slot = data->find_slot(k);
+        if(data->slot_at(slot).entry == 0) throw lookup_error();
+        data->prepare_erase(slot);
+
+        size_t n = data->slot_at(slot).entry - 1;
+        undo_entry change{undo_entry::erased, k, n, n, std::nullopt, {}};
+        change.value.emplace(std::move(data->own_value(n)));
+        if(data->boxed(n))
+            change.box = data->non_const_refs_given.extract(k);
+
+        log.changes.push_back(std::move(change));
+        data->erase_slot(slot);
+    }
+
+    void batch_assign(K const &k, V const &v, undo_log &log) { // strong
+        begin_batch(log);
+
+        size_t n = data->number_of(k);
+        if(n == data->used) {
+            batch_insert(k, v, log);
+            return;
+        }
+
+        make_room(log);
+        V replacement(v);
+        undo_entry change{undo_entry::assigned, k, n, n, std::nullopt, {}};
+        V &value = data->own_value(n);
+
+        change.value.emplace(std::move(value));
+        value = std::move(replacement);
+        log.changes.push_back(std::move(change));
+    }
+
+    // Undoes the logged changes, newest first, and ends the batch.
+    void undo(undo_log &log) noexcept {
+        bool indexed = !log.index;
+
+        for(size_t u = log.changes.size(); u-- > 0; ) {
+            undo_entry &change = log.changes[u];
+            size_t n = change.number;
+            std::uint32_t hash = indexed ? data->hash_of(change.key) : 0;
+            size_t i = indexed ? data->find_slot(change.key, hash) : 0;
+
+            switch(change.kind) {
+            case undo_entry::appended:
+                if(data->boxed(n))
+                    data->non_const_refs_given.erase(change.key);
+                if(indexed)
+                    data->erase_slot(i);
+                else
+                    data->unlink(n);
+                break;
+            case undo_entry::moved:
+                data->renumber(change.moved_to, n);
+                if(indexed)
+                    data->slot_at(i).entry = std::uint32_t(n + 1);
+                break;
+            case undo_entry::erased:
+                data->revive(n, std::move(change.key), std::move(*change.value));
+                if(change.box)
+                    data->rebox(n, std::move(change.box));
+                if(indexed)
+                    data->slots[i] = typename structure::slot{hash, std::uint32_t(n + 1)};
+                break;
+            case undo_entry::assigned:
+                data->own_value(n) = std::move(*change.value);
+                break;
+            }
+        }
+
+        if(!indexed) {
+            data->slots.swap(log.index->slots);
+            data->draining.swap(log.index->draining);
+            data->migrated = log.index->migrated;
+            log.index.reset();
+        }
+        log.changes.clear();
+        end_batch();
+    }
+
+    V const &at(K const &k) const {
+        if(is_small()) {
+            size_t i = small_find(k);
+            if(i == small_size) throw lookup_error();
+
+            return small_at(i).second;
+        }
+
+        V const *found = data->find(k);
+        if(found == nullptr) throw lookup_error();
+
+        return *found;
+    }
+
+    V &operator[](K const &k) {
+        bool inserted = insert(k, V());
+
+        try {
+            return at(k);
+        }
+        catch (...) {
+            if(inserted == true)
+                pop_back();
+            throw;
+        }
+    }
+
+    size_t size() const noexcept {
+        if(is_small())
+            return small_size;
+
+        return data->live;
+    }
+
+    /*
+     * Lets go of the structure instead of emptying it: shared data is left
+     * to its other owners and is never copied, and uniquely owned pages of
+     * trivially destructible entries are freed without visiting them.
+     */
+    void clear() noexcept {
+        reset();
+    }
+
+    void clear_in_background() {
+        if(!is_small())
+            iom_reclaimer::instance().retire(std::move(data));
+        reset();
+    }
+
+    bool contains(K const &k) const {
+        if(is_small())
+            return small_find(k) < small_size;
+
+        return data->find(k) != nullptr;
+    }
+
+    bool step(size_t budget) {
+        if(is_small()) return true;
+
+        copy_on_write();
+        return data->step(budget);
+    }
+
+    void save(std::ostream &os) const {
+        std::uint64_t header[5] = { serialization_magic, serialization_version, sizeof(K), sizeof(V), size() };
+        os.write(reinterpret_cast<char const *>(header), sizeof(header));
+
+        if constexpr (bulk_serializable) {
+            std::vector<char> buffer;
+            buffer.reserve(serialization_chunk * entry_bytes);
+
+            for_each([&os, &buffer](K const &k, V const &v) {
+                size_t offset = buffer.size();
+
+                buffer.resize(offset + entry_bytes);
+                std::memcpy(buffer.data() + offset, &k, sizeof(K));
+                std::memcpy(buffer.data() + offset + sizeof(K), &v, sizeof(V));
+
+                if(buffer.size() == serialization_chunk * entry_bytes) {
+                    os.write(buffer.data(), buffer.size());
+                    buffer.clear();
+                }
+            });
+            os.write(buffer.data(), buffer.size());
+        }
+        else {
+            for_each([&os](K const &k, V const &v) {
+                iom_serializer<K>::write(os, k);
+                iom_serializer<V>::write(os, v);
+            });
+        }
+
+        if(!os) throw serialization_error();
+    }
+
+    void load(std::istream &is) { // strong
+        std::uint64_t header[5];
+        is.read(reinterpret_cast<char *>(header), sizeof(header));
+        if(!is || header[0] != serialization_magic || header[1] != serialization_version
+           || header[2] != sizeof(K) || header[3] != sizeof(V) || header[4] > structure::max_entries)
+            throw serialization_error();
+        std::uint64_t const count = header[4];
+
+        map_structure loaded;
+        if(count > small_capacity)
+            loaded.become_large(std::make_shared<structure>());
+
+        // The count comes from the stream as well, so room is made only for
+        // entries that actually arrive, doubling like the index itself.
+        std::uint64_t room = 0;
+        auto make_room = [&loaded, &room, count](std::uint64_t done) {
+            if(loaded.is_small() || done < room) return;
+            room = std::min<std::uint64_t>(count, std::max<std::uint64_t>(2 * room,
+                                                                         serialization_chunk));
+            loaded.data->reserve(room);
+        };
+
+        auto append = [&loaded](K const &k, V const &v) {
+            if(!loaded.append(k, v))
+                throw serialization_error();
+        };
+
+        if constexpr (bulk_serializable) {
+            std::vector<char> buffer;
+
+            for(std::uint64_t done = 0; done < count; ) {
+                std::uint64_t chunk = std::min<std::uint64_t>(serialization_chunk, count - done);
+                make_room(done);
+                buffer.resize(chunk * entry_bytes);
+                is.read(buffer.data(), buffer.size());
+                if(!is) throw serialization_error();
+
+                // copied into place, so that K and V need no default constructor
+                for(char const *p = buffer.data(); p != buffer.data() + buffer.size();
+                    p += entry_bytes) {
+                    alignas(K) unsigned char k[sizeof(K)];
+                    alignas(V) unsigned char v[sizeof(V)];
+                    std::memcpy(k, p, sizeof(K));
+                    std::memcpy(v, p + sizeof(K), sizeof(V));
+                    append(*std::launder(reinterpret_cast<K const *>(k)),
+                           *std::launder(reinterpret_cast<V const *>(v)));
+                }
+                done += chunk;
+            }
+        }
+        else {
+            for(std::uint64_t i = 0; i < count; i++) {
+                make_room(i);
+                K k = iom_serializer<K>::read(is);
+                V v = iom_serializer<V>::read(is);
+                if(!is) throw serialization_error();
+
+                append(k, v);
+            }
+        }
+
+        *this = std::move(loaded);
+    }
+
+private:
+    static constexpr std::uint64_t serialization_magic = 0x50414d4f49ULL; // "IOMAP"
+    static constexpr std::uint64_t serialization_version = 2;
+    static constexpr size_t serialization_chunk = 4096;
+    static constexpr size_t entry_bytes = sizeof(K) + sizeof(V);
+    static constexpr bool bulk_serializable =
+            std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value;
+};
+
+template <class K, class V, class Hash>
+struct insertion_ordered_map<K, V, Hash>::map_structure::structure {
+    static constexpr bool trivially_copyable =
+            std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value;
+    static constexpr bool trivially_destructible =
+            std::is_trivially_destructible<K>::value && std::is_trivially_destructible<V>::value;
+    static constexpr bool nothrow_relocatable =
+            std::is_nothrow_move_constructible<K>::value && std::is_nothrow_move_constructible<V>::value;
+
+    /*
+     * Entries are kept in insertion order in fixed-size pages, which never
+     * move, so growing the map does not invalidate references to values.
+     * An erased or re-inserted entry leaves a tombstone behind; tombstones
+     * are squeezed out a few pages at a time by compact_step() once they
+     * outnumber live entries.
+     *
+     * A page stores keys and values in two separate arrays, so that runs of
+     * values can be scanned without stepping over keys. Pages of trivially
+     * copyable entries are copied with memcpy and pages of trivially
+     * destructible ones are freed without visiting their entries.
+     */
+    static constexpr size_t page_size = 64;
+
+    class page {
+    public:
+        // first, next to the reference count checked before every write
+        std::uint64_t alive;    // bit i is set when entry i is constructed
+        std::uint64_t boxed;    // bit i is set when value i is in a box, see share_value()
+
+    private:
+        alignas(K) unsigned char key_storage[page_size * sizeof(K)];
+        alignas(V) unsigned char value_storage[page_size * sizeof(V)];
+
+    public:
+
+        page() :
+                alive(0),
+                boxed(0) {}
+
+        // Boxes are not shared, so the copy has none, see structure(structure const &).
+        page(page const &other) :
+                alive(0),
+                boxed(0)
+        {
+            if constexpr (trivially_copyable) {
+                std::memcpy(key_storage, other.key_storage, sizeof(key_storage));
+                std::memcpy(value_storage, other.value_storage, sizeof(value_storage));
+                alive = other.alive;
+            }
+            else {
+                try {
+                    for(std::uint64_t bits = other.alive; bits != 0; bits &= bits - 1) {
+                        size_t i = lowest_bit(bits);
+                        construct(i, other.keys()[i], other.values()[i]);
+                        alive |= std::uint64_t(1) << i;
+                    }
+                }
+                catch (...) {
+                    destroy_all();
+                    throw;
+                }
+            }
+        }
+
+        ~page() {
+            destroy_all();
+        }
+
+        K *keys() noexcept {
+            return std::launder(reinterpret_cast<K *>(key_storage));
+        }
+
+        K const *keys() const noexcept {
+            return std::launder(reinterpret_cast<K const *>(key_storage));
+        }
+
+        V *values() noexcept {
+            return std::launder(reinterpret_cast<V *>(value_storage));
+        }
+
+        V const *values() const noexcept {
+            return std::launder(reinterpret_cast<V const *>(value_storage));
+        }
+
+        // Constructs entry i, still to be marked alive.
+        template <class KeyArg, class ValueArg>
+        void construct(size_t i, KeyArg &&k, ValueArg &&v) {
+            new (keys() + i) K(std::forward<KeyArg>(k));
+            try {
+                new (values() + i) V(std::forward<ValueArg>(v));
+            }
+            catch (...) {
+                keys()[i].~K();
+                throw;
+            }
+        }
+
+        // Constructs entry i from entry j of source, moving it if that
+        // cannot throw. A boxed value stays in its box.
+        void relocate(size_t i, page &source, size_t j) {
+            if constexpr (nothrow_relocatable)
+                construct(i, std::move(source.keys()[j]), std::move(source.values()[j]));
+            else
+                construct(i, std::as_const(source.keys()[j]), std::as_const(source.values()[j]));
+            boxed |= (source.boxed >> j & 1) << i;
+        }
+
+        void destroy(size_t i) noexcept {
+            if constexpr (!trivially_destructible) {
+                keys()[i].~K();
+                values()[i].~V();
+            }
+            alive &= ~(std::uint64_t(1) << i);
+            boxed &= ~(std::uint64_t(1) << i);
+        }
+
+        void destroy_all() noexcept {
+            if constexpr (!trivially_destructible) {
+                for(std::uint64_t bits = alive; bits != 0; bits &= bits - 1) {
+                    keys()[lowest_bit(bits)].~K();
+                    values()[lowest_bit(bits)].~V();
+                }
+            }
+            alive = 0;
+            boxed = 0;
+        }
+    };
+
+    /*
+     * Open addressing with linear probing; entry is the entry number + 1,
+     * 0 marks an empty slot. Both halves are 32 bits wide, which limits a
+     * map to max_entries entries; hash keeps the hash of the key as mixed
+     * by hash_of(), all the index ever uses.
+     */
+    struct slot {
+        std::uint32_t hash;
+        std::uint32_t entry;
+    };
+
+    static constexpr size_t max_entries = size_t(1) << 31;
+
+    // Marks a slot of the draining table whose key has moved on.
+    static constexpr std::uint32_t moved = ~std::uint32_t(0);
+
+    /*
+     * Like the pages of entries, a slot table is split into chunks that
+     * copies of the structure share until one of them writes, see own().
+     * A chunk is allocated with calloc, so that a large one is handed out
+     * zeroed by the system instead of being filled up front.
+     */
+    class slot_table {
+    private:
+        static constexpr size_t chunk_bits = 15;
+        static constexpr size_t chunk_size = size_t(1) << chunk_bits;
+
+        struct release_chunk {
+            void operator()(slot *chunk) const noexcept {
+                std::free(chunk);
+            }
+        };
+
+        std::vector<std::shared_ptr<slot>> chunks;
+        size_t count;
+
+        size_t chunk_length(size_t c) const noexcept {
+            return std::min(chunk_size, count - c * chunk_size);
+        }
+
+        static std::shared_ptr<slot> allocate(size_t length) {
+            slot *chunk = static_cast<slot *>(std::calloc(length, sizeof(slot)));
+            if(chunk == nullptr) throw std::bad_alloc();
+
+            return std::shared_ptr<slot>(chunk, release_chunk());
+        }
+
+    public:
+        slot_table() :
+                chunks(),
+                count(0) {}
+
+        explicit slot_table(size_t count) :
+                chunks(),
+                count(count)
+        {
+            chunks.reserve((count + chunk_size - 1) / chunk_size);
+            for(size_t c = 0; c * chunk_size < count; c++)
+                chunks.push_back(allocate(chunk_length(c)));
+        }
+
+        void swap(slot_table &other) noexcept {
+            chunks.swap(other.chunks);
+            std::swap(count, other.count);
+        }
+
+        size_t size() const noexcept { return count; }
+        bool empty() const noexcept { return count == 0; }
+        size_t chunk_count() const noexcept { return chunks.size(); }
+
+        slot const &operator[](size_t i) const noexcept {
+            return chunks[i >> chunk_bits].get()[i & (chunk_size - 1)];
+        }
+
+        // Only for slots whose chunk is owned.
+        slot &operator[](size_t i) noexcept {
+            return chunks[i >> chunk_bits].get()[i & (chunk_size - 1)];
+        }
+
+        // Copies chunk c if it is shared; returns whether it was.
+        bool own_chunk(size_t c) { // strong
+            if(chunks[c].use_count() == 1) return false;
+
+            std::shared_ptr<slot> copied = allocate(chunk_length(c));
+            std::memcpy(copied.get(), chunks[c].get(), chunk_length(c) * sizeof(slot));
+            chunks[c] = std::move(copied);
+            return true;
+        }
+
+        void own(size_t i) { // strong
+            own_chunk(i >> chunk_bits);
+        }
+
+        void own_all() { // strong
+            for(size_t c = 0; c < chunks.size(); c++)
+                own_chunk(c);
+        }
+
+        bool shared_chunk(size_t c) const noexcept {
+            return chunks[c].use_count() > 1;
+        }
+
+        bool shared() const noexcept {
+            for(size_t c = 0; c < chunks.size(); c++) {
+                if(shared_chunk(c))
+                    return true;
+            }
+            return false;
+        }
+    };
+
+    /*
+     * The index grows incrementally, like Redis' dict: a new table of twice
+     * the size takes over, the old one is kept as draining and a few of its
+     * slots are moved over by every modifying operation. Until it is empty,
+     * lookups consult both tables. A slot number below slots.size() is in
+     * slots, higher ones are in draining; keys only ever enter slots.
+     */
+    static constexpr size_t migration_step = 32;
+
+    /*
+     * Compaction is incremental too: once tombstones outnumber live
+     * entries, every modifying operation slides the live entries of up to
+     * compaction_step more pages down to the lowest free numbers, and the
+     * numbers freed at the end are reused when the last page is reached.
+     * Every operation adds at most one entry and slides up to 256, so a
+     * pass ends before tombstones can pile up again.
+     *
+     * The free numbers in front of the first live entry, which
+     * move_to_front() takes, are kept the same way: while fewer are left
+     * than two passes could take, a spreading pass first adds absent pages
+     * past the end, a few per operation, and then slides the live entries
+     * up to the top of them, the last entry first.
+     */
+    static constexpr size_t compaction_step = 4;
+
+    /*
+     * The keys whose values were given out by reference, with the boxes the
+     * values were moved into, see share_value().
+     */
+    using refmaptype = std::unordered_map<K, std::unique_ptr<V>, Hash>;
+
+    /*
+     * The pages, owned through blocks of 512 pointers that copies of the
+     * structure share like slot chunks, and reached through a flat array of
+     * plain pointers. Copying a structure thus copies the flat array but
+     * touches no page, and a page is copied when it is first written. While
+     * its block is shared, the reference count of a page does not tell
+     * whether the page is, so own() copies the block first.
+     */
+    class page_list {
+    private:
+        static constexpr size_t block_bits = 9;
+        static constexpr size_t block_size = size_t(1) << block_bits;
+
+        struct block {
+            std::shared_ptr<page> pages[block_size];
+        };
+
+        std::vector<page *> view;
+        std::vector<std::shared_ptr<block>> blocks;
+
+        std::shared_ptr<page> &owner(size_t p) noexcept {
+            return blocks[p >> block_bits]->pages[p & (block_size - 1)];
+        }
+
+        void own_block(size_t p) { // strong
+            std::shared_ptr<block> &b = blocks[p >> block_bits];
+            if(b.use_count() > 1)
+                b = std::make_shared<block>(*b);
+        }
+
+    public:
+        page_list() :
+                view(),
+                blocks() {}
+
+        // count pages, all absent
+        explicit page_list(size_t count) :
+                view(count, nullptr),
+                blocks()
+        {
+            blocks.reserve((count + block_size - 1) / block_size);
+            while(blocks.size() * block_size < count)
+                blocks.push_back(std::make_shared<block>());
+        }
+
+        void swap(page_list &other) noexcept {
+            view.swap(other.view);
+            blocks.swap(other.blocks);
+        }
+
+        size_t size() const noexcept { return view.size(); }
+
+        page const *operator[](size_t p) const noexcept {
+            return view[p];
+        }
+
+        // Only pages made owned by own() may be written.
+        page *operator[](size_t p) noexcept {
+            return view[p];
+        }
+
+        // Copies page p, and its block, if other structures share them.
+        void own(size_t p) { // strong
+            own_block(p);
+            if(owner(p).use_count() > 1)
+                set(p, std::make_shared<page>(*view[p]));
+        }
+
+        // Whether page p may be reached from other structures.
+        bool shared(size_t p) const noexcept {
+            return blocks[p >> block_bits].use_count() > 1
+                   || blocks[p >> block_bits]->pages[p & (block_size - 1)].use_count() > 1;
+        }
+
+        void set(size_t p, std::shared_ptr<page> replacement) { // strong
+            own_block(p);
+            view[p] = replacement.get();
+            owner(p) = std::move(replacement);
+        }
+
+        // Drops page p, which has to be owned.
+        void drop(size_t p) noexcept {
+            view[p] = nullptr;
+            owner(p) = nullptr;
+        }
+
+        void reserve(size_t n) { // strong
+            view.reserve(n);
+            blocks.reserve((n + block_size - 1) / block_size);
+        }
+
+        void push_back(std::shared_ptr<page> added) { // strong
+            view.push_back(nullptr);
+            try {
+                if(blocks.size() * block_size < view.size())
+                    blocks.push_back(std::make_shared<block>());
+                set(view.size() - 1, std::move(added));
+            }
+            catch(...) {
+                view.pop_back();
+                throw;
+            }
+        }
+    };
+
+    /*
+     * The entries ordered by key, for ordered_view: a copy of each key with
+     * its entry number, values staying in the pages. Items are kept in
+     * chunks of up to 2 * chunk_size, which copies of the structure share.
+     * sort_keys() builds the order when first needed and later merges in
+     * the entries numbered from high on, appended since, and those below
+     * low, moved to the front since. Erasing leaves stale items behind, whose
+     * entry is dead or holds another key; they are skipped, and dropped
+     * once they outnumber live entries. Renumbering entries drops the order.
+     */
+    struct key_order {
+        struct item {
+            K key;
+            std::uint32_t entry;
+        };
+        using chunk = std::vector<item>;
+        static constexpr size_t chunk_size = 512;
+
+        std::vector<std::shared_ptr<chunk const>> chunks;
+        size_t count;   // items, stale ones included
+        size_t low;     // entries numbered below low were never included
+        size_t high;    // nor were those from high on
+
+        // Appends sorted items, split into chunk_size chunks if too many for one.
+        void append(std::vector<item> &&items) { // strong
+            if(items.empty()) return;
+
+            size_t pieces = items.size() <= 2 * chunk_size ? 1 : (items.size() + chunk_size - 1) / chunk_size;
+            for(size_t p = 0; p < pieces; p++) {
+                auto from = items.begin() + items.size() * p / pieces;
+                auto to = items.begin() + items.size() * (p + 1) / pieces;
+                chunks.push_back(std::make_shared<chunk const>(std::make_move_iterator(from),
+                                                               std::make_move_iterator(to)));
+            }
+            count += items.size();
+        }
+    };
+
+    page_list pages;
+    std::vector<size_t> page_ranks;     // Fenwick tree of live entries per page
+    slot_table slots;
+    slot_table draining;
+    size_t migrated;                    // draining slots already moved
+    size_t detach_cursor;               // where step() resumes
+    std::uint64_t numbering;            // shared by structures numbering entries alike
+    size_t used;    // entries appended, tombstones included
+    size_t head;    // no live entry has a lower number
+    size_t live;
+    bool compacting;        // see compact_step
+    size_t compact_read;    // the next entry number to slide down
+    size_t compact_write;   // where it goes
+    bool spreading;         // see spread_step
+    size_t spread_read;     // entries numbered below are still to slide up
+    size_t spread_write;    // the lowest number slid to; 0 until pages are added
+    Hash hasher;
+    refmaptype non_const_refs_given;
+    bool batching;  // see map_structure::begin_batch
+    std::shared_ptr<key_order const> by_key;
+
+    structure() :
+            pages(),
+            page_ranks(),
+            slots(),
+            draining(),
+            migrated(0),
+            detach_cursor(0),
+            numbering(new_numbering()),
+            used(0),
+            head(0),
+            live(0),
+            compacting(false),
+            compact_read(0),
+            compact_write(0),
+            spreading(false),
+            spread_read(0),
+            spread_write(0),
+            hasher(),
+            non_const_refs_given(),
+            batching(false),
+            by_key() {};
+
+    /*
+     * Copying a structure copies only the plain pointers to its pages and
+     * the pointers to its page blocks and slot chunks, without touching the
+     * reference counts of pages. A page, block or chunk still shared with
+     * other structures is copied when it is first written; every modifying
+     * operation owns what it writes before changing anything, see own().
+     * step() copies them ahead of time.
+     *
+     * Values of other may be changed through references it has given out,
+     * so its pages are then copied up front, with those values copied back
+     * from their boxes, and so is all of it while a batch is open, as
+     * undoing the batch writes where it already owns.
+     */
+    structure(structure const &other) :
+            pages(other.pages),
+            page_ranks(other.page_ranks),
+            slots(other.slots),
+            draining(other.draining),
+            migrated(other.migrated),
+            detach_cursor(0),
+            numbering(other.numbering),
+            used(other.used),
+            head(other.head),
+            live(other.live),
+            compacting(other.compacting),
+            compact_read(other.compact_read),
+            compact_write(other.compact_write),
+            spreading(other.spreading),
+            spread_read(other.spread_read),
+            spread_write(other.spread_write),
+            hasher(other.hasher),
+            non_const_refs_given(),
+            batching(false),
+            by_key(other.by_key)
+    {
+        if(!other.non_const_refs_given.empty() || other.batching) {
+            for(size_t p = 0; p < pages.size(); p++) {
+                if(pages[p] != nullptr)
+                    pages.set(p, std::make_shared<page>(*pages[p]));
+            }
+            for(auto const &given: other.non_const_refs_given) {
+                size_t n = number_of(given.first);
+                pages[n / page_size]->values()[n % page_size] = *given.second;
+            }
+        }
+        if(other.batching) {
+            slots.own_all();
+            draining.own_all();
+        }
+    };
+
+    static std::uint64_t new_numbering() noexcept {
+        static std::atomic<std::uint64_t> last(0);
+        return ++last;
+    }
+
+    static size_t lowest_bit(std::uint64_t bits) noexcept {
+#if defined(__GNUC__)
+        return __builtin_ctzll(bits);
+#else
+        size_t i = 0;
+        while((bits & 1) == 0) {
+            bits >>= 1;
+            i++;
+        }
+        return i;
+#endif
+    }
+
+    static size_t popcount(std::uint64_t bits) noexcept {
+#if defined(__GNUC__)
+        return __builtin_popcountll(bits);
+#else
+        size_t count = 0;
+        for(; bits != 0; bits &= bits - 1)
+            count++;
+        return count;
+#endif
+    }
+
+    static void prefetch(void const *p) noexcept {
+#if defined(__GNUC__)
+        __builtin_prefetch(p);
+#else
+        (void) p;
+#endif
+    }
+
+    K const &key(size_t n) const noexcept {
+        return pages[n / page_size]->keys()[n % page_size];
+    }
+
+    V const &value(size_t n) const {
+        return value_of(*pages[n / page_size], n);
+    }
+
+    // The value of entry n, which is in page p.
+    V const &value_of(page const &p, size_t n) const {
+        size_t i = n % page_size;
+        if((p.boxed >> i & 1) == 0)
+            return p.values()[i];
+
+        return *non_const_refs_given.find(p.keys()[i])->second;
+    }
+
+    bool boxed(size_t n) const noexcept {
+        return (pages[n / page_size]->boxed >> (n % page_size) & 1) != 0;
+    }
+
+    bool is_alive(size_t n) const noexcept {
+        page const *p = pages[n / page_size];
+        return p != nullptr && (p->alive >> (n % page_size) & 1) != 0;
+    }
+
+    // The first live entry number not lower than n, or used if there is none.
+    size_t next(size_t n) const noexcept {
+        while(n < used) {
+            page const *p = pages[n / page_size];
+            std::uint64_t bits = p == nullptr ? 0 : p->alive >> (n % page_size);
+
+            if(bits != 0)
+                return n + lowest_bit(bits);
+            n = (n / page_size + 1) * page_size;
+
+            // a spreading pass leaves no live entry between its cursors
+            if(n >= spread_read && n < spread_write)
+                n = spread_write;
+        }
+        return used;
+    }
+
+    size_t first() const noexcept {
+        return next(head);
+    }
+
+    void count_live(size_t p, bool added) noexcept {
+        for(size_t i = p + 1; i <= page_ranks.size(); i += i & (0 - i)) {
+            if(added)
+                page_ranks[i - 1]++;
+            else
+                page_ranks[i - 1]--;
+        }
+    }
+
+    // Page p, copied first if other structures share it.
+    page &own(size_t p) { // strong
+        pages.own(p);
+        return *pages[p];
+    }
+
+    // The value of entry n in an owned page, or in its box.
+    V &own_value(size_t n) { // strong
+        page &p = own(n / page_size);
+        return const_cast<V &>(value_of(p, n));
+    }
+
+    /*
+     * The value of k, which has to be present, to be given out by
+     * reference. The first time, it is moved into a box of its own, where
+     * it stays until k is erased, so that the reference stays valid as the
+     * entry is moved or renumbered. The page keeps the moved-from value.
+     */
+    V &share_value(K const &k) { // strong
+        size_t n = number_of(k);
+        page &p = own(n / page_size);
+
+        auto given = non_const_refs_given.emplace(k, nullptr);
+        if(!given.second)
+            return *given.first->second;
+
+        try {
+            given.first->second = std::make_unique<V>(std::move_if_noexcept(p.values()[n % page_size]));
+        }
+        catch (...) {
+            non_const_refs_given.erase(given.first);
+            throw;
+        }
+        p.boxed |= std::uint64_t(1) << (n % page_size);
+        return *given.first->second;
+    }
+
+    /*
+     * Puts the value of revived entry n back into the box it was taken out
+     * of. The map holds no more keys than when the box was taken out, so
+     * reinserting it does not rehash and cannot throw.
+     */
+    void rebox(size_t n, typename refmaptype::node_type &&box) noexcept {
+        page &p = *pages[n / page_size];
+
+        *box.mapped() = std::move(p.values()[n % page_size]);
+        non_const_refs_given.insert(std::move(box));
+        p.boxed |= std::uint64_t(1) << (n % page_size);
+    }
+
+    // The page of n has to be owned.
+    void mark_alive(size_t n) noexcept {
+        pages[n / page_size]->alive |= std::uint64_t(1) << (n % page_size);
+        count_live(n / page_size, true);
+    }
+
+    // The page of n has to be owned.
+    void kill(size_t n) noexcept {
+        pages[n / page_size]->destroy(n % page_size);
+        count_live(n / page_size, false);
+    }
+
+    // The number of live entries in the pages before page p.
+    size_t rank_of_page(size_t p) const noexcept {
+        size_t rank = 0;
+        for(size_t i = p; i > 0; i -= i & (0 - i))
+            rank += page_ranks[i - 1];
+        return rank;
+    }
+
+    // The number of live entries numbered below n; the position of n if it
+    // is live.
+    size_t position(size_t n) const noexcept {
+        if(n >= used) return live;
+
+        std::uint64_t below = (std::uint64_t(1) << (n % page_size)) - 1;
+        page const *p = pages[n / page_size];
+        return rank_of_page(n / page_size) + (p == nullptr ? 0 : popcount(p->alive & below));
+    }
+
+    // Number of the live entry at position i < live of the insertion order.
+    size_t nth(size_t i) const noexcept {
+        size_t step = 1;
+        while(2 * step <= page_ranks.size())
+            step *= 2;
+
+        size_t p = 0;
+        for(; step > 0; step /= 2) {
+            if(p + step <= page_ranks.size() && page_ranks[p + step - 1] <= i) {
+                p += step;
+                i -= page_ranks[p - 1];
+            }
+        }
+
+        std::uint64_t bits = pages[p]->alive;
+        for(; i > 0; i--)
+            bits &= bits - 1;
+        return p * page_size + lowest_bit(bits);
+    }
+
+    // Fills ranks, of the size of pages, with the Fenwick tree of pages.
+    static void rank_pages(page_list const &pages, std::vector<size_t> &ranks) noexcept {
+        std::fill(ranks.begin(), ranks.end(), 0);
+
+        for(size_t i = 1; i <= ranks.size(); i++) {
+            if(pages[i - 1] != nullptr)
+                ranks[i - 1] += popcount(pages[i - 1]->alive);
+
+            size_t parent = i + (i & (0 - i));
+            if(parent <= ranks.size())
+                ranks[parent - 1] += ranks[i - 1];
+        }
+    }
+
+    template <class F>
+    void for_each(F f) const {
+        for(size_t i = 0; i < pages.size(); i++) {
+            page const *p = pages[i];
+            if(p == nullptr) continue;
+
+            for(std::uint64_t bits = p->alive; bits != 0; bits &= bits - 1)
+                f(p->keys()[lowest_bit(bits)], value_of(*p, i * page_size + lowest_bit(bits)));
+        }
+    }
+
+    // Like for_each, but f also gets the entry number.
+    template <class F>
+    void for_each_numbered(F f) const {
+        for(size_t p = 0; p < pages.size(); p++) {
+            if(pages[p] == nullptr) continue;
+
+            for(std::uint64_t bits = pages[p]->alive; bits != 0; bits &= bits - 1) {
+                size_t i = lowest_bit(bits);
+                f(p * page_size + i, pages[p]->keys()[i], value_of(*pages[p], p * page_size + i));
+            }
+        }
+    }
+
+    /*
+     * The hash of k as the index uses it: multiplied by 2^64 / phi, of
+     * which the top 32 bits are kept, and the top bits of those pick the
+     * home slot. Every bit of the hash thus moves the home slot, so
+     * sequential or strided hashes, like the identity std::hash gives
+     * integers, spread over the table instead of forming clusters that
+     * every probe and backward-shift erasure goes through.
+     */
+    std::uint32_t hash_of(K const &k) const {
+        return std::uint32_t((std::uint64_t(hasher(k)) * 0x9e3779b97f4a7c15ULL) >> 32);
+    }
+
+    // The home slot of hash in a table of size slots, a power of two.
+    static size_t home(std::uint32_t hash, size_t size) noexcept {
+        return size_t((std::uint64_t(hash) * size) >> 32);
+    }
+
+    slot &slot_at(size_t i) noexcept {
+        return i < slots.size() ? slots[i] : draining[i - slots.size()];
+    }
+
+    slot const &slot_at(size_t i) const noexcept {
+        return i < slots.size() ? slots[i] : draining[i - slots.size()];
+    }
+
+    /*
+     * The slot holding k, or the empty slot of slots where it would be
+     * inserted. Slot numbers stay valid in a copy of the structure.
+     */
+    size_t find_slot(K const &k, std::uint32_t hash) const {
+        size_t mask = slots.size() - 1;
+        size_t i = home(hash, slots.size());
+
+        while(slots[i].entry != 0) {
+            if(slots[i].hash == hash && key(slots[i].entry - 1) == k)
+                return i;
+            i = (i + 1) & mask;
+        }
+
+        if(!draining.empty()) {
+            size_t draining_mask = draining.size() - 1;
+
+            for(size_t j = home(hash, draining.size()); draining[j].entry != 0;
+                j = (j + 1) & draining_mask) {
+                if(draining[j].entry != moved && draining[j].hash == hash
+                   && key(draining[j].entry - 1) == k)
+                    return slots.size() + j;
+            }
+        }
+        return i;
+    }
+
+    size_t find_slot(K const &k) const {
+        return find_slot(k, hash_of(k));
+    }
+
+    /*
+     * Looks every key of this structure up in other, calling f(n, m) for
+     * its entry n, in no particular order, with m the number of the entry
+     * of the key in other, or other.used if there is none. A stateless
+     * hasher hashes alike in both, so the hashes cached in the index are
+     * used instead of hashing keys again. Lookups go in batches: the home
+     * slots of a batch are prefetched, then the keys they point to, and
+     * only then is any of them probed.
+     */
+    template <class F>
+    void probe(structure const &other, F f) const {
+        constexpr size_t batch_size = 16;
+        size_t size = other.slots.size();
+        size_t numbers[batch_size];
+        std::uint32_t hashes[batch_size];
+        size_t count = 0;
+
+        auto flush = [&] {
+            for(size_t j = 0; j < count; j++)
+                prefetch(&other.slots[home(hashes[j], size)]);
+            for(size_t j = 0; j < count; j++) {
+                std::uint32_t entry = other.slots[home(hashes[j], size)].entry;
+                if(entry != 0)
+                    prefetch(&other.key(entry - 1));
+            }
+
+            for(size_t j = 0; j < count; j++) {
+                size_t i = other.find_slot(key(numbers[j]), hashes[j]);
+                std::uint32_t entry = other.slot_at(i).entry;
+                f(numbers[j], entry == 0 ? other.used : entry - 1);
+            }
+            count = 0;
+        };
+
+        for_each_slot([&](slot const &s) {
+            numbers[count] = s.entry - 1;
+            hashes[count] = std::is_empty<Hash>::value ? s.hash : other.hash_of(key(s.entry - 1));
+            if(++count == batch_size)
+                flush();
+        });
+        flush();
+    }
+
+    // The number of the entry of k, or used if k is absent.
+    size_t number_of(K const &k) const {
+        size_t i = find_slot(k);
+        return slot_at(i).entry == 0 ? used : slot_at(i).entry - 1;
+    }
+
+    /*
+     * Whether a and b are copies of one structure that were not compacted
+     * since, so that a key that kept its number was not moved.
+     */
+    static bool numbered_alike(structure const &a, structure const &b) noexcept {
+        return a.numbering == b.numbering;
+    }
+
+    /*
+     * Passes runs of consecutive live entries numbered from n on to
+     * f(keys, values, count), up to limit entries in all; returns the
+     * number to continue from. A boxed value is passed in a run of its own.
+     */
+    template <class F>
+    size_t read(size_t n, size_t limit, F f) const {
+        for(n = next(n); limit > 0 && n < used; n = next(n)) {
+            page const &p = *pages[n / page_size];
+            size_t i = n % page_size;
+
+            if(p.boxed >> i & 1) {
+                f(p.keys() + i, &value_of(p, n), 1);
+                n++;
+                limit--;
+                continue;
+            }
+
+            // the shift brings in zeros, so the run ends within the page
+            std::uint64_t ends = ~(p.alive >> i) | (p.boxed >> i);
+            size_t count = std::min(ends == 0 ? page_size : lowest_bit(ends), limit);
+
+            f(p.keys() + i, p.values() + i, count);
+            n += count;
+            limit -= count;
+        }
+        return n;
+    }
+
+    // Compares the pages that from and to, numbered alike, do not share.
+    static void diff_pages(structure const &from, structure const &to,
+                           typename insertion_ordered_map::changes &result) {
+        size_t count = std::max(from.pages.size(), to.pages.size());
+
+        for(size_t p = 0; p < count; p++) {
+            page const *before = p < from.pages.size() ? from.pages[p] : nullptr;
+            page const *after = p < to.pages.size() ? to.pages[p] : nullptr;
+            if(before == after) continue;
+
+            if(before != nullptr) {
+                for(std::uint64_t bits = before->alive; bits != 0; bits &= bits - 1) {
+                    K const &k = before->keys()[lowest_bit(bits)];
+                    if(to.find(k) == nullptr)
+                        result.erased.push_back(k);
+                }
+            }
+
+            if(after != nullptr) {
+                for(std::uint64_t bits = after->alive; bits != 0; bits &= bits - 1) {
+                    size_t n = p * page_size + lowest_bit(bits);
+                    K const &k = after->keys()[lowest_bit(bits)];
+                    size_t old = from.number_of(k);
+
+                    if(old == from.used) {
+                        result.inserted.push_back(k);
+                        continue;
+                    }
+
+                    if(old != n)
+                        result.reordered.push_back(k);
+                    if(!(from.value(old) == to.value_of(*after, n)))
+                        result.changed.push_back(k);
+                }
+            }
+        }
+    }
+
+    V const *find(K const &k) const {
+        size_t i = find_slot(k);
+        return slot_at(i).entry == 0 ? nullptr : &value(slot_at(i).entry - 1);
+    }
+
+    // Places a slot of a key that is not in table yet.
+    static void place(slot_table &table, slot const &s) { // strong
+        size_t mask = table.size() - 1;
+        size_t i = home(s.hash, table.size());
+
+        while(table[i].entry != 0)
+            i = (i + 1) & mask;
+        table.own(i);
+        table[i] = s;
+    }
+
+    template <class F>
+    void for_each_slot(F f) const {
+        for(size_t i = 0; i < slots.size(); i++) {
+            if(slots[i].entry != 0)
+                f(slots[i]);
+        }
+        for(size_t i = 0; i < draining.size(); i++) {
+            if(draining[i].entry != 0 && draining[i].entry != moved)
+                f(draining[i]);
+        }
+    }
 
-    structure() :
-            mappings(),
-            insertions(),
-            non_const_refs_given() {};
+    /*
+     * Moves up to budget slots of draining over to slots. Throws only
+     * between two slots, leaving every key reachable.
+     */
+    void migrate(size_t budget) {
+        for(; budget > 0 && migrated < draining.size(); budget--, migrated++) {
+            slot s = draining[migrated];
+
+            if(s.entry != 0 && s.entry != moved) {
+                draining.own(migrated);
+                place(slots, s);
+                draining[migrated].entry = moved;
+            }
+        }
 
-    structure(structure const &other) :
-            mappings(other.mappings),
-            insertions(other.insertions),
-            non_const_refs_given()
-    {
-        for(auto it = insertions.begin(); it != insertions.end(); it++) {
-            mappings[*it].iter = it;
+        if(migrated == draining.size()) {
+            slot_table drained;
+            draining.swap(drained);
+            migrated = 0;
+        }
+    }
+
+    // Rehashes everything into a table of the given capacity at once.
+    void rehash(size_t capacity) { // strong
+        slot_table rehashed(capacity);
+
+        for_each_slot([&rehashed](slot const &s) {
+            place(rehashed, s);
+        });
+        slots.swap(rehashed);
+        draining = slot_table();
+        migrated = 0;
+    }
+
+    // Makes room for n entries at a load factor of at most 3/4 at once.
+    void reserve(size_t n) { // strong
+        size_t capacity = slots.empty() ? 32 : slots.size();
+        while(4 * n > 3 * capacity)
+            capacity *= 2;
+
+        if(capacity != slots.size() || !draining.empty())
+            rehash(capacity);
+        pages.reserve((n + page_size - 1) / page_size);
+    }
+
+    /*
+     * Makes room for one more entry, doubling the index incrementally when
+     * it gets too full. A previous doubling has always finished by then:
+     * there are at most as many slots left to migrate as there are free
+     * slots in the new table, and every insertion migrates 32 of them.
+     */
+    void grow() { // strong
+        if(slots.empty()) {
+            reserve(1);
+            return;
+        }
+
+        migrate(migration_step);
+        if(4 * (live + 1) <= 3 * slots.size()) return;
+
+        if(!draining.empty())
+            migrate(draining.size());
+
+        slot_table doubled(2 * slots.size());
+        draining.swap(slots);
+        slots.swap(doubled);
+        migrated = 0;
+    }
+
+    // The owned page of the next entry at the end of the order.
+    page &back_page() { // strong
+        if(used == max_entries) throw std::length_error("insertion_ordered_map");
+
+        // a finished compaction leaves pages past used, dropped
+        if(used / page_size < pages.size()) {
+            if(pages[used / page_size] == nullptr)
+                pages.set(used / page_size, std::make_shared<page>());
+        }
+        else {
+            add_page(std::make_shared<page>());
+        }
+
+        return own(used / page_size);
+    }
+
+    void add_page(std::shared_ptr<page> added) { // strong
+        size_t i = pages.size() + 1;
+
+        // a new tree node covers the pages (i - lowbit(i), i]
+        page_ranks.push_back(rank_of_page(i - 1) - rank_of_page(i - (i & (0 - i))));
+        try {
+            pages.push_back(std::move(added));
+        }
+        catch (...) {
+            page_ranks.pop_back();
+            throw;
+        }
+    }
+
+    // Whether tombstones outnumber live entries, or free numbers in front
+    // of them twice do, unless a batch is open.
+    bool worth_compacting() const noexcept {
+        size_t bound = std::max(live, page_size);
+        return !batching && (used - head - live > bound || head > 2 * bound);
+    }
+
+    // How many operations a pass may take at most, with some to spare.
+    size_t pass_length() const noexcept {
+        return (used - head) / (compaction_step * page_size / 2) + 4;
+    }
+
+    /*
+     * Slides the live entries of up to compaction_step pages down to the
+     * lowest free numbers, starting a pass if worth_compacting(). A slid
+     * entry keeps its place in the order, as every live entry numbered
+     * below it was slid before it. Entries are renumbered, and numbers are
+     * reused at the end, so the numbering changes with every step. Throws only between two entries, leaving
+     * each where it is or where it was slid to.
+     *
+     * The free numbers in front are kept, down to as many as there are
+     * live entries. When a pass could leave too few of them, a spreading
+     * pass runs instead, see spread_step().
+     */
+    void compact_step() { // strong
+        if(batching) return;
+        if(spreading) {
+            spread_step();
+            return;
+        }
+        if(!compacting) {
+            bool worth = worth_compacting();
+            if(head < (worth ? 3 : 2) * pass_length()) {
+                spreading = true;
+                spread_step();
+                return;
+            }
+            if(!worth) return;
+
+            compacting = true;
+            compact_read = head;
+            compact_write = std::min(head, std::max(live, page_size));
+        }
+
+        // an absent page costs as much as one entry
+        size_t budget = compaction_step * page_size;
+        size_t slid = 0;
+        while(budget > 0 && compact_read < used) {
+            size_t end = std::min((compact_read / page_size + 1) * page_size, used);
+
+            if(pages[compact_read / page_size] == nullptr) {
+                compact_read = end;
+                budget--;
+                continue;
+            }
+
+            for(; compact_read < end; compact_read++) {
+                if(!is_alive(compact_read)) continue;
+
+                if(compact_read != compact_write) {
+                    slide(compact_read, compact_write);
+                    slid++;
+                }
+                compact_write++;
+            }
+            budget -= std::min(budget, page_size);
+        }
+
+        if(slid > 0 || compact_read >= used) {
+            numbering = new_numbering();
+            by_key.reset();
+        }
+        if(compact_read < used) return;
+
+        // the pages past the slid entries are empty
+        for(size_t p = (compact_write + page_size - 1) / page_size; p < pages.size(); p++) {
+            if(pages[p] != nullptr)
+                pages.set(p, nullptr);
+        }
+        used = compact_write;
+        head = std::min(head, used);
+        compacting = false;
+    }
+
+    /*
+     * Adds absent pages past the end until there are free numbers for
+     * half the live entries, then slides the live entries of up to
+     * compaction_step pages up to the highest free numbers below the new
+     * end, last entry first, so that each keeps its place in the order.
+     * Tombstones are squeezed out on the way, and the numbers below the
+     * first slid entry are left free. Like compact_step(), throws only
+     * between two entries.
+     */
+    void spread_step() { // strong
+        // an absent page costs as much as one entry
+        size_t budget = compaction_step * page_size;
+
+        if(spread_write == 0) {
+            size_t top = std::min(used + std::max(page_size, live / 2), max_entries);
+            for(; budget > 0 && pages.size() * page_size < top; budget--)
+                add_page(nullptr);
+            if(pages.size() * page_size < top) return;
+
+            spread_read = used;
+            used = pages.size() * page_size;
+            spread_write = used;
+        }
+
+        size_t slid = 0;
+        while(budget > 0 && spread_read > head) {
+            size_t begin = std::max((spread_read - 1) / page_size * page_size, head);
+
+            if(pages[(spread_read - 1) / page_size] == nullptr) {
+                spread_read = begin;
+                budget--;
+                continue;
+            }
+
+            for(; spread_read > begin; spread_read--) {
+                if(!is_alive(spread_read - 1)) continue;
+
+                if(spread_read != spread_write) {
+                    slide(spread_read - 1, spread_write - 1);
+                    slid++;
+                }
+                spread_write--;
+            }
+            budget -= std::min(budget, page_size);
+        }
+
+        if(slid > 0 || spread_read <= head) {
+            numbering = new_numbering();
+            by_key.reset();
+        }
+        if(spread_read > head) return;
+
+        head = spread_write;
+        spreading = false;
+        spread_read = 0;
+        spread_write = 0;
+    }
+
+    // Relocates live entry n to free number m, which no live entry lies
+    // between.
+    void slide(size_t n, size_t m) { // strong
+        if(pages[m / page_size] == nullptr)
+            pages.set(m / page_size, std::make_shared<page>());
+
+        size_t i = find_slot(key(n));
+        own_slot(i);
+        page &target = own(m / page_size);
+        target.relocate(m % page_size, own(n / page_size), n % page_size);
+        mark_alive(m);
+
+        release(n);
+        slot_at(i).entry = std::uint32_t(m + 1);
+        head = std::min(head, m);
+    }
+
+    // Marks the entry constructed in back_page() alive.
+    void push_back() noexcept {
+        mark_alive(used);
+        used++;
+    }
+
+    // Inserts a key known to be absent; returns false if it is present.
+    bool append(K const &k, V const &v) { // strong
+        compact_step();
+        grow();
+
+        std::uint32_t hash = hash_of(k);
+        size_t i = find_slot(k, hash);
+        if(slot_at(i).entry != 0) return false;
+
+        slots.own(i);
+        back_page().construct(used % page_size, k, v);
+        push_back();
+        slots[i] = slot{hash, std::uint32_t(used)};
+        live++;
+        return true;
+    }
+
+    // The value of k in an owned page; if k is absent, it is first appended
+    // with the value make() returns.
+    template <class Make>
+    V &find_or_append(K const &k, Make &make, bool &inserted) { // strong
+        compact_step();
+        grow();
+
+        std::uint32_t hash = hash_of(k);
+        size_t i = find_slot(k, hash);
+        inserted = slot_at(i).entry == 0;
+        if(!inserted)
+            return own_value(slot_at(i).entry - 1);
+
+        slots.own(i);
+        page &back = back_page();
+        back.construct(used % page_size, k, make());
+        V &value = back.values()[used % page_size];
+
+        push_back();
+        slots[i] = slot{hash, std::uint32_t(used)};
+        live++;
+        return value;
+    }
+
+    // Like append, but a present key is moved to the end of the order.
+    bool insert(K const &k, V const &v) { // strong
+        compact_step();
+        grow();
+
+        std::uint32_t hash = hash_of(k);
+        size_t i = find_slot(k, hash);
+        if(slot_at(i).entry == 0) {
+            slots.own(i);
+            back_page().construct(used % page_size, k, v);
+            push_back();
+            slots[i] = slot{hash, std::uint32_t(used)};
+            live++;
+            return true;
+        }
+
+        move_to_back(i);
+        return false;
+    }
+
+    // Relocates the entry of slot i to the end of the order.
+    void move_to_back(size_t i) { // strong
+        compact_step();
+
+        size_t old = slot_at(i).entry - 1;
+        if(next(old + 1) == used) return;
+
+        own_slot(i);
+        page &target = back_page();
+        target.relocate(used % page_size, own(old / page_size), old % page_size);
+        push_back();
+
+        kill(old);
+        slot_at(i).entry = std::uint32_t(used);
+        if(old == head)
+            head = next(old + 1);
+    }
+
+    /*
+     * Relocates the entry of slot i to the free number in front of the
+     * first live entry, which compact_step() keeps some of. A batch holds
+     * passes back, so only one that appended many entries can leave none;
+     * compaction then leaves a gap at the front proportional to the size
+     * of the map at once.
+     */
+    void move_to_front(size_t i) { // strong
+        compact_step();
+
+        size_t front = first();
+        if(slot_at(i).entry - 1 == front) return;
+
+        if(front == 0) {
+            compact(std::max(page_size, live / 2));
+            front = first();
+        }
+
+        // Past the read cursor of a pass, the entry would be left behind:
+        // no live entry is left below it, so the entry is taken as slid.
+        size_t old = slot_at(i).entry - 1;
+        size_t n = front - 1;
+        bool passed = compacting && n >= compact_write && n < compact_read;
+        if(passed)
+            n = compact_write;
+        if(pages[n / page_size] == nullptr)
+            pages.set(n / page_size, std::make_shared<page>());
+
+        own_slot(i);
+        page &target = own(n / page_size);
+        target.relocate(n % page_size, own(old / page_size), old % page_size);
+        mark_alive(n);
+
+        kill(old);
+        slot_at(i).entry = std::uint32_t(n + 1);
+        head = n;
+        if(passed)
+            compact_write++;
+        if(n >= spread_read && n < spread_write)
+            spread_write = n;
+
+        // n may be the number of a stale item of the key order
+        if(by_key && n >= by_key->low)
+            by_key.reset();
+    }
+
+    // Destroys live entry n, whose page has to be owned, freeing the page if
+    // it was the last one there.
+    void release(size_t n) noexcept {
+        kill(n);
+        if(!batching && pages[n / page_size]->alive == 0 && n / page_size != (used - 1) / page_size)
+            pages.drop(n / page_size);
+    }
+
+    void own_slot(size_t i) { // strong
+        if(i < slots.size())
+            slots.own(i);
+        else
+            draining.own(i - slots.size());
+    }
+
+    /*
+     * Owns whatever erase_slot(i) writes: the page of the entry and the
+     * slots up to the end of the cluster, which the backward shift moves.
+     */
+    void prepare_erase(size_t i) { // strong
+        own((slot_at(i).entry - 1) / page_size);
+        own_slot(i);
+        if(i >= slots.size()) return;
+
+        size_t mask = slots.size() - 1;
+        for(size_t j = (i + 1) & mask; slots[j].entry != 0; j = (j + 1) & mask)
+            slots.own(j);
+    }
+
+    // Erases live entry n, whose page has to be owned, but not its slot.
+    void unlink(size_t n) noexcept {
+        release(n);
+        if(n == head)
+            head = next(n + 1);
+        live--;
+    }
+
+    // The slot has to be prepared by prepare_erase(i).
+    void erase_slot(size_t i) noexcept {
+        unlink(slot_at(i).entry - 1);
+
+        if(i >= slots.size()) {
+            // the draining table keeps its clusters until it is dropped
+            draining[i - slots.size()].entry = moved;
+        } else {
+            // backward shift: pull up every entry of the cluster that may
+            // not be reachable from its home slot any more
+            size_t mask = slots.size() - 1;
+            for(size_t j = (i + 1) & mask; slots[j].entry != 0; j = (j + 1) & mask) {
+                size_t start = home(slots[j].hash, slots.size());
+                bool reachable = i <= j ? (i < start && start <= j) : (i < start || start <= j);
+
+                if(!reachable) {
+                    slots[i] = slots[j];
+                    i = j;
+                }
+            }
+            slots[i].entry = 0;
+        }
+    }
+
+    /*
+     * Erases count live entries, which doomed(f) passes to f one by one in
+     * increasing order. A batch of more than a quarter of the map is not
+     * unlinked key by key: the index is rebuilt from the cached hashes of
+     * the survivors in one sweep, so no key is hashed or compared. Either
+     * way, everything is allocated before the first entry is erased.
+     */
+    template <class Doomed>
+    void erase_many(size_t count, Doomed doomed) { // strong
+        if(count == 0) return;
+
+        if(4 * count <= live) {
+            // erasing a slot only writes to its cluster, which the
+            // erasures before it only shorten
+            doomed([this](size_t n) {
+                prepare_erase(find_slot(key(n)));
+            });
+            drop_boxes(doomed);
+            doomed([this](size_t n) {
+                erase_slot(find_slot(key(n)));
+            });
+            return;
+        }
+
+        doomed([this](size_t n) {
+            own(n / page_size);
+        });
+        slot_table kept(slots.size());
+        drop_boxes(doomed);
+
+        doomed([this](size_t n) {
+            release(n);
+        });
+        head = next(head);
+        live -= count;
+
+        for_each_slot([this, &kept](slot const &s) {
+            if(is_alive(s.entry - 1))
+                place(kept, s);
+        });
+        slots.swap(kept);
+        draining = slot_table();
+        migrated = 0;
+    }
+
+    // Drops the boxes of the values of the doomed entries, if any.
+    template <class Doomed>
+    void drop_boxes(Doomed &doomed) {
+        if(non_const_refs_given.empty()) return;
+
+        doomed([this](size_t n) {
+            if(boxed(n))
+                non_const_refs_given.erase(key(n));
+        });
+    }
+
+    // Erases the live entries numbered from from up to, but excluding, to.
+    void erase_run(size_t from, size_t to) { // strong
+        erase_many(position(to) - position(from), [this, from, to](auto f) {
+            for(size_t n = next(from); n < to; n = next(n + 1))
+                f(n);
+        });
+    }
+
+    // Erases the listed live entries, given in increasing order.
+    void erase_listed(std::vector<size_t> const &doomed) { // strong
+        erase_many(doomed.size(), [&doomed](auto f) {
+            for(size_t n: doomed)
+                f(n);
+        });
+    }
+
+    /*
+     * Undoing changes of a batch, leaving the index to the caller: entry n
+     * is dead, and its page is owned and kept. renumber() moves live entry
+     * from back to n; revive() puts k back as entry n.
+     */
+    void renumber(size_t from, size_t n) noexcept {
+        if(from == n) return;
+
+        pages[n / page_size]->relocate(n % page_size, *pages[from / page_size], from % page_size);
+        mark_alive(n);
+        kill(from);
+        head = std::min(head, n);
+        by_key.reset();
+    }
+
+    void revive(size_t n, K &&k, V &&v) noexcept {
+        pages[n / page_size]->construct(n % page_size, std::move(k), std::move(v));
+        mark_alive(n);
+        live++;
+        head = std::min(head, n);
+        by_key.reset();
+    }
+
+    /*
+     * Renumbers live entries contiguously from gap on, keeping their order;
+     * the first gap numbers are left free for move_to_front(). Strong: all
+     * allocation happens first, and entries are only moved out of owned
+     * pages when that cannot throw.
+     */
+    void compact(size_t gap) {
+        page_list compacted((gap + live + page_size - 1) / page_size);
+        for(size_t p = gap / page_size; p < compacted.size(); p++)
+            compacted.set(p, std::make_shared<page>());
+
+        std::vector<size_t> compacted_ranks(compacted.size());
+        slots.own_all();
+        draining.own_all();
+
+        size_t n = gap;
+        for(size_t q = 0; q < pages.size(); q++) {
+            page *p = pages[q];
+            if(p == nullptr) continue;
+
+            bool owned = !pages.shared(q);
+            for(std::uint64_t bits = p->alive; bits != 0; bits &= bits - 1) {
+                page &target = *compacted[n / page_size];
+                size_t i = lowest_bit(bits);
+
+                if(owned)
+                    target.relocate(n % page_size, *p, i);
+                else
+                    target.construct(n % page_size, std::as_const(p->keys()[i]), std::as_const(p->values()[i]));
+                target.alive |= std::uint64_t(1) << (n % page_size);
+                n++;
+            }
+        }
+
+        rank_pages(compacted, compacted_ranks);
+
+        for(size_t i = 0; i < slots.size(); i++) {
+            if(slots[i].entry != 0)
+                slots[i].entry = gap + position(slots[i].entry - 1) + 1;
+        }
+        for(size_t i = 0; i < draining.size(); i++) {
+            if(draining[i].entry != 0 && draining[i].entry != moved)
+                draining[i].entry = gap + position(draining[i].entry - 1) + 1;
+        }
+
+        pages.swap(compacted);
+        page_ranks.swap(compacted_ranks);
+        used = gap + live;
+        head = gap;
+        compacting = false;
+        spreading = false;
+        spread_read = 0;
+        spread_write = 0;
+        numbering = new_numbering();
+        by_key.reset();
+    }
+
+    // Whether item i of the key order stands for a live entry.
+    bool current(typename key_order::item const &i) const {
+        return is_alive(i.entry) && key(i.entry) == i.key;
+    }
+
+    bool keys_sorted() const noexcept {
+        return by_key && by_key->high == used && by_key->low <= first()
+               && by_key->count <= 2 * live + key_order::chunk_size;
+    }
+
+    /*
+     * Builds the key order, or brings it up to date. The entries added
+     * since it was last updated are sorted and merged into the chunks they
+     * fall in, which are copied without their stale items; other chunks are
+     * shared with the previous order, which is left as it was.
+     */
+    void sort_keys() { // strong
+        using item = typename key_order::item;
+        auto ordered = [](item const &a, item const &b) {
+            return a.key < b.key;
+        };
+        key_order sorted{{}, 0, first(), used};
+
+        if(!by_key || by_key->count > 2 * live + key_order::chunk_size) {
+            std::vector<item> items;
+            items.reserve(live);
+            for_each_numbered([&items](size_t n, K const &k, V const &) {
+                items.push_back(item{k, std::uint32_t(n)});
+            });
+            std::sort(items.begin(), items.end(), ordered);
+            sorted.append(std::move(items));
+
+            by_key = std::make_shared<key_order const>(std::move(sorted));
+            return;
+        }
+
+        std::vector<item> added;
+        for(size_t n = first(); n < by_key->low; n = next(n + 1))
+            added.push_back(item{key(n), std::uint32_t(n)});
+        for(size_t n = next(by_key->high); n < used; n = next(n + 1))
+            added.push_back(item{key(n), std::uint32_t(n)});
+        std::sort(added.begin(), added.end(), ordered);
+        sorted.low = std::min(sorted.low, by_key->low);
+
+        auto from = added.begin();
+        sorted.chunks.reserve(by_key->chunks.size() + added.size() / key_order::chunk_size + 1);
+        for(size_t c = 0; c < by_key->chunks.size(); c++) {
+            auto const &chunk = *by_key->chunks[c];
+            auto to = c + 1 == by_key->chunks.size() ? added.end()
+                                                     : std::upper_bound(from, added.end(), chunk.back(), ordered);
+            if(from == to) {
+                sorted.chunks.push_back(by_key->chunks[c]);
+                sorted.count += chunk.size();
+                continue;
+            }
+
+            std::vector<item> merged;
+            merged.reserve(chunk.size() + (to - from));
+            auto old = chunk.begin();
+            for(; from != to; ++from) {
+                for(; old != chunk.end() && !(from->key < old->key); ++old) {
+                    if(current(*old))
+                        merged.push_back(*old);
+                }
+                merged.push_back(std::move(*from));
+            }
+            for(; old != chunk.end(); ++old) {
+                if(current(*old))
+                    merged.push_back(*old);
+            }
+            sorted.append(std::move(merged));
+        }
+        sorted.append(std::vector<item>(std::make_move_iterator(from), std::make_move_iterator(added.end())));
+
+        by_key = std::make_shared<key_order const>(std::move(sorted));
+    }
+
+    // The first current item of the key order from chunk c, index i on, or
+    // the end, which is past the last chunk.
+    void skip_stale(size_t &c, size_t &i) const {
+        auto const &chunks = by_key->chunks;
+        for(; c < chunks.size(); c++, i = 0) {
+            for(; i < chunks[c]->size(); i++) {
+                if(current((*chunks[c])[i])) return;
+            }
+        }
+        i = 0;
+    }
+
+    // Where the first item with a key not less than k, or greater than k if
+    // after, is or would be in the key order, as chunk and index.
+    std::pair<size_t, size_t> key_bound(K const &k, bool after) const {
+        auto before = [&k, after](typename key_order::item const &i) {
+            return after ? !(k < i.key) : i.key < k;
+        };
+        auto const &chunks = by_key->chunks;
+
+        size_t c = std::partition_point(chunks.begin(), chunks.end(), [&before](auto const &chunk) {
+            return before(chunk->back());
+        }) - chunks.begin();
+        if(c == chunks.size()) return {c, 0};
+
+        return {c, size_t(std::partition_point(chunks[c]->begin(), chunks[c]->end(), before) - chunks[c]->begin())};
+    }
+
+    /*
+     * Copies up to budget pages or slot chunks still shared with other
+     * structures, resuming where the previous call stopped. Returns true
+     * once it has gone round everything without running out of budget.
+     */
+    bool step(size_t budget) { // strong
+        size_t units = pages.size() + slots.chunk_count() + draining.chunk_count();
+
+        for(size_t examined = 0; examined < units; examined++) {
+            size_t u = detach_cursor % units;
+            size_t c = u - pages.size();
+            bool shared;
+
+            if(u < pages.size())
+                shared = pages[u] != nullptr && pages.shared(u);
+            else if(c < slots.chunk_count())
+                shared = slots.shared_chunk(c);
+            else
+                shared = draining.shared_chunk(c - slots.chunk_count());
+
+            if(shared) {
+                if(budget == 0) return false;
+
+                if(u < pages.size())
+                    own(u);
+                else if(c < slots.chunk_count())
+                    slots.own_chunk(c);
+                else
+                    draining.own_chunk(c - slots.chunk_count());
+                budget--;
+            }
+            detach_cursor++;
         }
+        return true;
+    }
+};
+
+/*
+ * Streams the contents of a map as they were when the cursor was created.
+ * The cursor shares the structure of the map like a copy does, so writers
+ * are not blocked and their changes do not show through. Entries come in
+ * batches of spans, runs of entries stored next to each other in insertion
+ * order, which stay valid as long as the cursor. Keys and values come in
+ * separate arrays, so a span of values can be aggregated in a tight loop.
+ */
+template <class K, class V, class Hash>
+class insertion_ordered_map<K, V, Hash>::cursor {
+public:
+    // count keys and their values, stored in two arrays
+    struct span {
+        K const *keys;
+        V const *values;
+        size_t count;
+    };
+
+    /*
+     * Where a cursor stopped. A cursor over a later version of the map can
+     * resume from it, with entries inserted or moved to the back since then
+     * included and those moved to the front skipped. That fails with
+     * lookup_error once the map has been compacted, which renumbers its
+     * entries. In maps small enough to keep their entries inline, see
+     * map_structure::small_capacity, the position is an index.
+     */
+    struct token {
+        std::uint64_t numbering;
+        std::uint64_t position;
     };
 
-    static mapvaluetype mapValue(typename keylisttype::iterator iter, V value) {
-        return mapvaluetype(iter, value);
+private:
+    map_structure snapshot;
+    token at;
+
+public:
+
+    explicit cursor(insertion_ordered_map const &source) :
+            snapshot(source.map),
+            at{snapshot.pin(), 0} {}
+
+    cursor(insertion_ordered_map const &source, token resumed) :
+            snapshot(source.map),
+            at(resumed)
+    {
+        if(snapshot.pin() != resumed.numbering) throw lookup_error();
+    }
+
+    // Replaces batch with spans of up to limit entries; returns their
+    // number, which is 0 at the end.
+    size_t next(std::vector<span> &batch, size_t limit) {
+        batch.clear();
+
+        return snapshot.read(at.position, limit, [&batch](K const *keys, V const *values, size_t count) {
+            batch.push_back(span{keys, values, count});
+        });
     }
 
+    token position() const noexcept {
+        return at;
+    }
+};
+
+/*
+ * The entries of a map ordered by key, as they were when the view was made
+ * by insertion_ordered_map::by_key(). Like a cursor, the view shares the
+ * structure of the map, so the map can be modified meanwhile without the
+ * changes showing through, and its iterators stay valid as long as it.
+ */
+template <class K, class V, class Hash>
+class insertion_ordered_map<K, V, Hash>::ordered_view {
+public:
+    using iterator = typename map_structure::key_iterator;
+
+private:
+    friend class insertion_ordered_map;
+
+    map_structure snapshot;
+
+    // A map keeping its entries inline has no key order, so the view sorts
+    // its own.
+    explicit ordered_view(map_structure const &sorted) :
+            snapshot(sorted)
+    {
+        snapshot.pin();
+        snapshot.sort_keys();
+    }
+
+public:
+
+    iterator begin() const {
+        return snapshot.keys_begin();
+    }
+
+    iterator end() const {
+        return snapshot.keys_end();
+    }
+
+    // The first entry whose key is not less than k, or end().
+    iterator lower_bound(K const &k) const {
+        return snapshot.key_bound(k, false);
+    }
+
+    // The first entry whose key is greater than k, or end().
+    iterator upper_bound(K const &k) const {
+        return snapshot.key_bound(k, true);
+    }
+
+    size_t size() const noexcept {
+        return snapshot.size();
+    }
+};
+
+/*
+ * The changes of one insertion_ordered_map::batch(). A map that is small
+ * when the batch starts is copied and restored from the copy; otherwise
+ * every change is logged together with what undoing it needs.
+ */
+template <class K, class V, class Hash>
+class insertion_ordered_map<K, V, Hash>::transaction {
+    static_assert(std::is_nothrow_move_constructible<K>::value
+                  && std::is_nothrow_move_constructible<V>::value
+                  && std::is_nothrow_move_assignable<V>::value,
+                  "transactions require keys and values that move without throwing");
+
+private:
+    friend class insertion_ordered_map;
+
+    using undo_log = typename map_structure::undo_log;
+
+    map_structure &map;
+    std::optional<map_structure> backup;
+    undo_log log;
+    bool aborted;
+
+    explicit transaction(map_structure &map) :
+            map(map),
+            backup(),
+            log(),
+            aborted(false)
+    {
+        if(!map.begin_batch(log))
+            backup.emplace(map);
+    }
+
+    void roll_back() noexcept {
+        if(backup)
+            map = std::move(*backup);
+        else
+            map.undo(log);
+    }
+
+    void commit() noexcept {
+        map.end_batch();
+    }
+
+public:
+    transaction(transaction const &) = delete;
+
+    // Same as insertion_ordered_map::insert and erase.
+    bool insert(K const &k, V const &v) {
+        if(backup)
+            return map.insert(k, v);
+
+        return map.batch_insert(k, v, log);
+    }
+
+    void erase(K const &k) {
+        if(backup)
+            map.erase(k);
+        else
+            map.batch_erase(k, log);
+    }
+
+    // Replaces the value of k, keeping its place, or inserts k at the back.
+    void assign(K const &k, V const &v) {
+        if(backup) {
+            auto make = [&v] { return v; };
+            auto replace = [&v](V &value) { value = v; };
+            map.upsert(k, make, replace);
+        }
+        else {
+            map.batch_assign(k, v, log);
+        }
+    }
+
+    V const &at(K const &k) const {
+        return std::as_const(map).at(k);
+    }
+
+    bool contains(K const &k) const {
+        return map.contains(k);
+    }
+
+    size_t size() const noexcept {
+        return map.size();
+    }
+
+    // The batch keeps none of its changes, including later ones.
+    void abort() noexcept {
+        aborted = true;
+    }
 };
 
 #endif
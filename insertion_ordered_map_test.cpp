@@ -0,0 +1,1686 @@
+// Tests of insertion_ordered_map.h. Build and run with
+//     g++ -std=c++17 -pthread -fsanitize=address,undefined insertion_ordered_map_test.cpp && ./a.out
+
+#include "insertion_ordered_map.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <new>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <utility>
+
+namespace {
+    std::atomic<size_t> allocations(0);
+    std::atomic<size_t> allocation_limit(~size_t(0));    // where operator new starts throwing
+}
+
+// Replaced allocation functions are kept out of line, so that GCC never
+// sees an inlined std::free paired with a call to operator new.
+[[gnu::noinline]] void *operator new(size_t size)
+{
+    if (allocations >= allocation_limit)
+        throw std::bad_alloc();
+    allocations++;
+    if (void *p = std::malloc(size))
+        return p;
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+[[gnu::noinline]] void operator delete(void *p, size_t) noexcept
+{
+    std::free(p);
+}
+
+namespace {
+    // What a map should hold: its entries in insertion order.
+    template <class K, class V>
+    struct model {
+        std::vector<std::pair<K, V>> entries;
+
+        typename std::vector<std::pair<K, V>>::iterator find(K const &k)
+        {
+            auto it = entries.begin();
+            while (it != entries.end() && !(it->first == k))
+                ++it;
+            return it;
+        }
+
+        bool contains(K const &k)
+        {
+            return find(k) != entries.end();
+        }
+
+        bool insert(K const &k, V const &v)
+        {
+            auto it = find(k);
+            if (it == entries.end()) {
+                entries.emplace_back(k, v);
+                return true;
+            }
+            move_to_back(k);
+            return false;
+        }
+
+        void erase(K const &k)
+        {
+            entries.erase(find(k));
+        }
+
+        void move_to_back(K const &k)
+        {
+            auto it = find(k);
+            std::rotate(it, it + 1, entries.end());
+        }
+
+        void move_to_front(K const &k)
+        {
+            auto it = find(k);
+            std::rotate(entries.begin(), it, it + 1);
+        }
+    };
+
+    template <class K, class V, class Hash>
+    std::vector<std::pair<K, V>> entries(insertion_ordered_map<K, V, Hash> const &m)
+    {
+        std::vector<std::pair<K, V>> result;
+        for (auto it = m.begin(), end = m.end(); it != end; ++it)
+            result.emplace_back((*it).first, (*it).second);
+        return result;
+    }
+
+    template <class Map>
+    std::string saved(Map const &m)
+    {
+        std::ostringstream os;
+        m.save(os);
+        return os.str();
+    }
+
+    template <class Map>
+    bool load_fails(Map &m, std::string const &bytes)
+    {
+        std::istringstream is(bytes);
+        try {
+            m.load(is);
+        }
+        catch (serialization_error const &) {
+            return true;
+        }
+        return false;
+    }
+
+    // Trivially copyable, but not default constructible.
+    struct point {
+        int x, y;
+
+        point(int x, int y) : x(x), y(y) {}
+
+        bool operator==(point const &other) const
+        {
+            return x == other.x && y == other.y;
+        }
+    };
+
+    void test_serialization()
+    {
+        // trivially copyable entries take the bulk path, strings the serializer
+        for (int n : {0, 3, 1000}) {
+            insertion_ordered_map<int, long> ints;
+            insertion_ordered_map<std::string, std::string> strings;
+            for (int i = 0; i < n; ++i) {
+                ints.insert(i * 7, i);
+                strings.insert(std::to_string(i), std::string(i % 50, 'x'));
+            }
+            if (n > 0) {
+                ints.insert(0, 0);
+                strings.insert("0", "");
+            }
+
+            insertion_ordered_map<int, long> ints_loaded;
+            ints_loaded.insert(-1, -1);
+            std::istringstream is(saved(ints));
+            ints_loaded.load(is);
+            assert(entries(ints_loaded) == entries(ints));
+
+            insertion_ordered_map<std::string, std::string> strings_loaded;
+            std::istringstream ss(saved(strings));
+            strings_loaded.load(ss);
+            assert(entries(strings_loaded) == entries(strings));
+        }
+
+        // the bulk path copies entries into place, needing no default constructor
+        insertion_ordered_map<int, point> points;
+        for (int i = 0; i < 20; ++i)
+            points.insert(i, point(i, -i));
+        insertion_ordered_map<int, point> points_loaded;
+        std::istringstream ps(saved(points));
+        points_loaded.load(ps);
+        assert(entries(points_loaded) == entries(points));
+
+        insertion_ordered_map<int, int> m;
+        for (int i = 0; i < 100; ++i)
+            m.insert(i, -i);
+        std::string good = saved(m);
+        auto before = entries(m);
+
+        // magic, version, key size, value size and count
+        size_t const header = 40, version_at = 8, count_at = 32;
+
+        // a rejected stream leaves the map as it was
+        std::string bad_magic = good;
+        bad_magic[0] ^= 1;
+        assert(load_fails(m, bad_magic));
+        assert(entries(m) == before);
+
+        std::string bad_version = good;
+        bad_version[version_at] ^= 1;
+        assert(load_fails(m, bad_version));
+
+        // entries of other sizes are not reinterpreted
+        insertion_ordered_map<long, int> longs;
+        insertion_ordered_map<int, long> long_values;
+        assert(load_fails(longs, good) && load_fails(long_values, good));
+        assert(longs.empty() && long_values.empty());
+        insertion_ordered_map<std::string, std::string> no_strings;
+        assert(load_fails(no_strings, good));
+
+        std::string huge_count = good;
+        std::uint64_t count = std::uint64_t(1) << 62;
+        huge_count.replace(count_at, sizeof(count), reinterpret_cast<char const *>(&count), sizeof(count));
+        assert(load_fails(m, huge_count));
+
+        // the count is within limits, but the entries never arrive
+        std::string missing = good.substr(0, header);
+        count = 1000000;
+        missing.replace(count_at, sizeof(count), reinterpret_cast<char const *>(&count), sizeof(count));
+        assert(load_fails(m, missing));
+
+        assert(load_fails(m, good.substr(0, good.size() - 1)));
+        assert(load_fails(m, good.substr(0, 5)));
+        assert(entries(m) == before);
+
+        // the same key twice
+        insertion_ordered_map<int, int> two;
+        two.insert(1, 1);
+        two.insert(2, 2);
+        std::string duplicated = saved(two);
+        duplicated.replace(header + 2 * sizeof(int), sizeof(int), duplicated, header, sizeof(int));
+        assert(load_fails(m, duplicated));
+
+        std::string long_string = saved(insertion_ordered_map<std::string, std::string>());
+        count = 1;
+        long_string.replace(count_at, sizeof(count), reinterpret_cast<char const *>(&count), sizeof(count));
+        std::uint64_t length = std::uint64_t(1) << 60;
+        long_string.append(reinterpret_cast<char const *>(&length), sizeof(length));
+        insertion_ordered_map<std::string, std::string> strings;
+        assert(load_fails(strings, long_string));
+
+        // file paths
+        std::string path = "insertion_ordered_map_test.iom";
+        m.save(path);
+        insertion_ordered_map<int, int> from_file;
+        from_file.load(path);
+        assert(entries(from_file) == before);
+        std::remove(path.c_str());
+        assert(load_fails(from_file, ""));
+
+        bool failed = false;
+        try {
+            from_file.load(path);
+        }
+        catch (serialization_error const &) {
+            failed = true;
+        }
+        assert(failed);
+    }
+
+    // Runs random operations on keys 0 to 11, across the inline capacity.
+    void test_small_maps()
+    {
+        std::mt19937 random(28);
+        for (int round = 0; round < 300; ++round) {
+            insertion_ordered_map<std::string, std::string> m;
+            model<std::string, std::string> expected;
+
+            for (int op = 0; op < 40; ++op) {
+                std::string k = std::to_string(random() % 12);
+                std::string v = std::to_string(op);
+
+                switch (random() % 8) {
+                case 0:
+                case 1:
+                    assert(m.insert(k, v) == expected.insert(k, v));
+                    break;
+                case 2:
+                    if (expected.contains(k)) {
+                        m.erase(k);
+                        expected.erase(k);
+                    }
+                    break;
+                case 3:
+                    if (expected.contains(k)) {
+                        m.move_to_back(k);
+                        expected.move_to_back(k);
+                    }
+                    break;
+                case 4:
+                    if (expected.contains(k)) {
+                        m.move_to_front(k);
+                        expected.move_to_front(k);
+                    }
+                    break;
+                case 5:
+                    if (!expected.entries.empty()) {
+                        m.pop_front();
+                        expected.entries.erase(expected.entries.begin());
+                    }
+                    break;
+                case 6:
+                    if (expected.entries.size() >= 3) {
+                        m.erase(m.nth(1), m.nth(3));
+                        expected.entries.erase(expected.entries.begin() + 1, expected.entries.begin() + 3);
+                    }
+                    break;
+                case 7:
+                    m[k] = v;
+                    if (!expected.insert(k, v))
+                        expected.entries.back().second = v;
+                    break;
+                }
+
+                assert(entries(m) == expected.entries);
+                insertion_ordered_map<std::string, std::string> copy(m);
+                assert(entries(copy) == expected.entries);
+            }
+        }
+
+        // entries stay in their cells while others come and go
+        insertion_ordered_map<int, std::string> m;
+        for (int i = 0; i < 4; ++i)
+            m.insert(i, std::to_string(i));
+        std::string &ref = m.at(2);
+        m.insert(4, "4");
+        m.insert(2, "ignored");
+        m.erase(0);
+        m.move_to_front(2);
+        m.move_to_back(1);
+        m.erase_if([](int k, std::string const &) { return k == 3; });
+        ref = "changed";
+        assert(m.at(2) == "changed");
+        assert((entries(m) == std::vector<std::pair<int, std::string>>{{2, "changed"}, {4, "4"}, {1, "1"}}));
+
+        // a map, inline entries included, fits in a cache line
+        static_assert(sizeof(insertion_ordered_map<int, int>) <= 64);
+        static_assert(sizeof(insertion_ordered_map<std::uint64_t, std::uint64_t>) <= 64);
+        static_assert(sizeof(insertion_ordered_map<std::string, std::string>) <= 64);
+
+        // nothing is allocated until a map grows past its inline capacity,
+        // or gives out a reference
+        size_t before = allocations;
+        {
+            insertion_ordered_map<int, int> ints;
+            for (int i = 0; i < 4; ++i)
+                ints.insert(i, i);
+            ints.update(1, [](int &v) { v = 10; });
+            insertion_ordered_map<int, int> copy(ints);
+            copy.erase(3);
+            insertion_ordered_map<int, int> moved(std::move(copy));
+
+            insertion_ordered_map<std::string, std::string> strings;
+            insertion_ordered_map<std::string, std::string> copied(strings);
+            assert(strings.empty() && copied.empty());
+            assert(std::as_const(ints).at(1) == 10 && moved.size() == 3);
+        }
+        assert(allocations == before);
+
+        insertion_ordered_map<int, int> grown;
+        for (int i = 0; i < 9; ++i)
+            grown.insert(i, i);
+        assert(allocations > before);
+        assert(grown.size() == 9 && grown.at(0) == 0 && grown.at(8) == 8);
+    }
+
+    // A reference given out stays valid until its key is erased.
+    void test_references()
+    {
+        insertion_ordered_map<int, int> m;
+        for (int i = 0; i < 100; ++i)
+            m.insert(i, i);
+        int &r = m.at(5);
+        m.insert(5, 0);
+        m.move_to_front(5);
+        m.move_to_back(5);
+        r = 42;
+        assert(m.at(5) == 42);
+        assert((*m.nth(99)).first == 5 && (*m.nth(99)).second == 42);
+
+        // compaction moves the other entries around the pinned one
+        insertion_ordered_map<int, std::string> strings;
+        for (int i = 0; i < 1000; ++i)
+            strings.insert(i, std::to_string(i));
+        std::string &s = strings[999];
+        for (int i = 0; i < 900; ++i)
+            strings.erase(i);
+        for (int i = 1000; i < 1100; ++i)
+            strings.insert(i, std::to_string(i));
+        s = "pinned";
+        assert(strings.at(999) == "pinned");
+        assert(strings.nth(99) != strings.end() && (*strings.nth(99)).second == "pinned");
+
+        // copies read the value, and do not share it
+        insertion_ordered_map<int, std::string> copy(strings);
+        s = "changed";
+        assert(copy.at(999) == "pinned" && strings.at(999) == "changed");
+        std::vector<std::pair<int, std::string>> expected;
+        for (int i = 900; i < 1100; ++i)
+            expected.emplace_back(i, i == 999 ? "changed" : std::to_string(i));
+        assert(entries(strings) == expected);
+
+        // a pinned key erased in an aborted batch comes back in its box
+        strings.batch([&](auto &batch) {
+            batch.erase(999);
+            batch.abort();
+        });
+        s = "restored";
+        assert(strings.at(999) == "restored");
+
+        strings.erase(999);
+        strings.insert(999, "new");
+        assert(strings.at(999) == "new");
+
+        // a small map moves a value out of line before giving it out, so
+        // the reference survives growing past the inline capacity
+        insertion_ordered_map<std::string, std::string> small;
+        for (int i = 0; i < 8; ++i)
+            small.insert("k" + std::to_string(i), std::string(40, 'a' + i));
+        small["new"] = small["k3"];
+        assert(small.at("new") == std::string(40, 'd') && small.size() == 9);
+
+        insertion_ordered_map<int, std::string> growing;
+        growing.insert(1, "one");
+        std::string &one = growing.at(1);
+        for (int i = 2; i < 20; ++i)
+            growing.insert(i, std::to_string(i));
+        one = "still one";
+        assert(&std::as_const(growing).at(1) == &one && growing.at(1) == "still one");
+
+        // and a batch that grows a map, committed or not
+        insertion_ordered_map<int, std::string> batched;
+        for (int i = 0; i < 4; ++i)
+            batched.insert(i, std::to_string(i));
+        std::string &b1 = batched.at(1);
+        for (bool keep : {true, false}) {
+            batched.batch([keep](auto &batch) {
+                for (int i = 10; i < 30; ++i)
+                    batch.insert(i, std::to_string(i));
+                if (batch.contains(2))
+                    batch.erase(2);
+                if (!keep)
+                    batch.abort();
+            });
+            b1 = keep ? "kept" : "aborted";
+            assert(&std::as_const(batched).at(1) == &b1 && batched.at(1) == b1);
+        }
+        assert(batched.size() == 23 && !batched.contains(2));
+    }
+
+    // Holds references to values given out at random while random
+    // operations run on a few keys, so that maps keep growing and shrinking
+    // across the inline capacity; each reference has to stay on its value.
+    void test_held_references()
+    {
+        using map = insertion_ordered_map<int, std::string>;
+        std::mt19937 random(280);
+
+        for (int round = 0; round < 200; ++round) {
+            map m;
+            model<int, std::string> expected;
+            std::map<int, std::string *> held;
+
+            auto value = [&random](int op) {
+                return std::to_string(op) + std::string(random() % 40, 'v');
+            };
+
+            for (int op = 0; op < 100; ++op) {
+                int k = random() % 12;
+                std::string v = value(op);
+
+                switch (random() % 10) {
+                case 0:
+                case 1:
+                    assert(m.insert(k, v) == expected.insert(k, v));
+                    break;
+                case 2:
+                    if (expected.contains(k)) {
+                        m.erase(k);
+                        expected.erase(k);
+                        held.erase(k);
+                    }
+                    break;
+                case 3:
+                    if (expected.contains(k)) {
+                        if (random() % 2 == 0) {
+                            m.move_to_back(k);
+                            expected.move_to_back(k);
+                        }
+                        else {
+                            m.move_to_front(k);
+                            expected.move_to_front(k);
+                        }
+                    }
+                    break;
+                case 4:
+                    if (!expected.entries.empty()) {
+                        held.erase(expected.entries.front().first);
+                        m.pop_front();
+                        expected.entries.erase(expected.entries.begin());
+                    }
+                    break;
+                case 5:
+                    held[k] = &m[k];
+                    *held[k] = v;
+                    if (!expected.insert(k, v))
+                        expected.entries.back().second = v;
+                    break;
+                case 6:
+                    if (expected.contains(k)) {
+                        held[k] = &m.at(k);
+                        expected.find(k)->second = v;
+                        *held[k] = v;
+                    }
+                    break;
+                case 7:
+                    if (!held.empty()) {
+                        auto it = held.begin();
+                        std::advance(it, random() % held.size());
+                        *it->second = v;
+                        expected.find(it->first)->second = v;
+                    }
+                    break;
+                case 8: {
+                    bool keep = random() % 2 == 0;
+                    model<int, std::string> changed = expected;
+                    std::vector<int> erased;
+                    m.batch([&](auto &batch) {
+                        for (int i = random() % 10; i > 0; --i) {
+                            int key = random() % 12;
+                            if (random() % 3 == 0 && changed.contains(key)) {
+                                batch.erase(key);
+                                changed.erase(key);
+                                erased.push_back(key);
+                            }
+                            else {
+                                std::string made = value(op);
+                                batch.insert(key, made);
+                                changed.insert(key, made);
+                            }
+                        }
+                        if (!keep)
+                            batch.abort();
+                    });
+                    if (keep) {
+                        // a key erased and inserted again has a new value
+                        expected = changed;
+                        for (int key : erased)
+                            held.erase(key);
+                    }
+                    break;
+                }
+                case 9: {
+                    map other;
+                    for (int i = random() % 6; i > 0; --i) {
+                        int key = random() % 12;
+                        std::string made = value(op);
+                        other.insert(key, made);
+                        expected.insert(key, made);
+                    }
+                    m.merge(other);
+                    break;
+                }
+                }
+
+                assert(entries(m) == expected.entries);
+                for (auto const &h : held) {
+                    assert(&std::as_const(m).at(h.first) == h.second);
+                    assert(*h.second == expected.find(h.first)->second);
+                }
+            }
+        }
+    }
+
+    // Checks that the low 10 bits of hash(key(i)), for 2^16 keys, fill
+    // their 1024 buckets evenly.
+    template <class Hash, class Key>
+    void check_spread(Hash hash, Key key)
+    {
+        std::vector<int> buckets(1024);
+        for (int i = 0; i < 1 << 16; ++i)
+            buckets[hash(key(i)) & 1023]++;
+
+        // 64 keys per bucket expected, with a standard deviation of 8
+        auto bounds = std::minmax_element(buckets.begin(), buckets.end());
+        assert(*bounds.first > 16 && *bounds.second < 128);
+        double chi_square = 0;
+        for (int count : buckets)
+            chi_square += (count - 64.0) * (count - 64.0) / 64.0;
+        assert(chi_square < 1300);
+    }
+
+    void test_hash()
+    {
+        std::uint64_t const seeds[] = {0, 1, 0x5eed, iom_hash_seed()};
+        std::string const text = "the quick brown fox jumps over the lazy dog, twice over: "
+                                 "the quick brown fox jumps over the lazy dog";
+
+        // the same seed hashes alike, whatever the type of string
+        assert(iom_hash<long>()(12345) == iom_hash<long>()(12345));
+        assert(iom_hash<std::string>()(text) == iom_hash<std::string_view>()(text));
+        for (std::uint64_t seed : seeds) {
+            for (size_t length = 0; length <= text.size(); ++length) {
+                assert(iom_hash_bytes(text.data(), length, seed)
+                       == iom_hash_bytes(std::string(text, 0, length).data(), length, seed));
+            }
+            assert(iom_hash_bits(42, seed) == iom_hash_bits(42, seed));
+        }
+
+        // different seeds hash differently, as do different lengths
+        for (size_t a = 0; a < 4; ++a) {
+            for (size_t b = a + 1; b < 4; ++b) {
+                int same = 0;
+                for (std::uint64_t k = 0; k < 1000; ++k)
+                    same += iom_hash_bits(k << 7, seeds[a]) == iom_hash_bits(k << 7, seeds[b]);
+                for (size_t length = 0; length <= text.size(); ++length)
+                    same += iom_hash_bytes(text.data(), length, seeds[a]) == iom_hash_bytes(text.data(), length, seeds[b]);
+                assert(same == 0);
+            }
+        }
+        std::vector<size_t> prefixes;
+        for (size_t length = 0; length <= text.size(); ++length)
+            prefixes.push_back(iom_hash<std::string_view>()(std::string_view(text.data(), length)));
+        std::sort(prefixes.begin(), prefixes.end());
+        assert(std::unique(prefixes.begin(), prefixes.end()) == prefixes.end());
+
+        // the low bits, which index small tables, spread sequential and
+        // strided integers, and strings differing in a few characters
+        iom_hash<std::uint64_t> integers;
+        check_spread(integers, [](std::uint64_t i) { return i; });
+        check_spread(integers, [](std::uint64_t i) { return i << 10; });
+        check_spread(integers, [](std::uint64_t i) { return i << 21; });
+        check_spread(integers, [](std::uint64_t i) { return 3 * i << 32; });
+        check_spread(integers, [](std::uint64_t i) { return i << 48; });
+        check_spread(iom_hash<int *>(), [](std::uint64_t i) { return reinterpret_cast<int *>(i * 64); });
+        check_spread(iom_hash<std::string>(), [](std::uint64_t i) { return "key " + std::to_string(i); });
+        check_spread(iom_hash<std::string>(), [](std::uint64_t i) {
+            return std::string(100, 'x') + std::to_string(i) + std::string(100, 'y');
+        });
+        for (std::uint64_t seed : seeds)
+            check_spread([seed](std::uint64_t k) { return iom_hash_bits(k, seed); }, [](std::uint64_t i) { return i << 32; });
+    }
+
+    // The index mixes hashes, so the identity std::hash of sequential or
+    // strided keys forms no clusters, which pop_front() would shift
+    // through in quadratic time.
+    void test_identity_hash()
+    {
+        for (long stride : {1L, 1L << 21, 3L << 32}) {
+            insertion_ordered_map<long, long, std::hash<long>> m;
+            for (long i = 0; i < 50000; ++i)
+                m.insert(i * stride, i);
+            for (long i = 0; i < 50000; i += 7)
+                assert(std::as_const(m).at(i * stride) == i && !m.contains(-1 - i));
+            for (long i = 0; i < 25000; ++i) {
+                assert((*m.begin()).first == i * stride);
+                m.pop_front();
+            }
+            for (long i = 49999; i >= 25000; --i)
+                m.erase(i * stride);
+            assert(m.empty());
+        }
+    }
+
+    // Runs random operations on a large map, so that compaction passes run
+    // between and across them.
+    void test_compaction()
+    {
+        std::mt19937 random(35);
+        insertion_ordered_map<int, std::string> m;
+        model<int, std::string> expected;
+        insertion_ordered_map<int, std::string> copy;
+        std::vector<std::pair<int, std::string>> copied;
+
+        for (int op = 0; op < 30000; ++op) {
+            int k = random() % 3000;
+            std::string v = std::to_string(op);
+
+            switch (random() % 10) {
+            case 0:
+            case 1:
+            case 2:
+                assert(m.insert(k, v) == expected.insert(k, v));
+                break;
+            case 3:
+            case 4:
+            case 5:
+                if (expected.contains(k)) {
+                    m.erase(k);
+                    expected.erase(k);
+                }
+                break;
+            case 6:
+                if (expected.contains(k)) {
+                    m.move_to_back(k);
+                    expected.move_to_back(k);
+                }
+                break;
+            case 7:
+                if (expected.contains(k)) {
+                    m.move_to_front(k);
+                    expected.move_to_front(k);
+                }
+                break;
+            case 8:
+                m[k] = v;
+                if (!expected.insert(k, v))
+                    expected.entries.back().second = v;
+                break;
+            case 9:
+                if (expected.contains(k)) {
+                    m.update(k, [&v](std::string &value) { value = v; });
+                    expected.find(k)->second = v;
+                }
+                break;
+            }
+
+            if (op % 500 == 0) {
+                assert(entries(m) == expected.entries);
+                assert(entries(copy) == copied);
+                copy = m;
+                copied = expected.entries;
+            }
+        }
+        assert(entries(m) == expected.entries);
+        assert(m.size() == expected.entries.size());
+        for (size_t i = 0; i < expected.entries.size(); i += 97)
+            assert((*m.nth(i)).first == expected.entries[i].first);
+
+        // erasing most of the map, then refilling it
+        for (int i = 0; i < 3000; ++i) {
+            if (i % 10 != 0 && expected.contains(i)) {
+                m.erase(i);
+                expected.erase(i);
+            }
+        }
+        for (int i = 3000; i < 4000; ++i) {
+            m.insert(i, std::to_string(i));
+            expected.insert(i, std::to_string(i));
+        }
+        assert(entries(m) == expected.entries);
+
+        // a pass over a map with no live entry left starts over from 0
+        insertion_ordered_map<int, int> emptied;
+        for (int i = 0; i < 1000; ++i)
+            emptied.insert(i, i);
+        for (int i = 0; i < 1000; ++i)
+            emptied.erase(i);
+        emptied.insert(-1, -1);
+        assert((entries(emptied) == std::vector<std::pair<int, int>>{{-1, -1}}));
+    }
+
+    // Counts its live instances.
+    struct counted {
+        static std::atomic<int> live;
+
+        int value;
+
+        counted(int value = 0) :
+                value(value)
+        {
+            live++;
+        }
+
+        counted(counted const &other) :
+                value(other.value)
+        {
+            live++;
+        }
+
+        counted &operator=(counted const &other) = default;
+
+        ~counted()
+        {
+            live--;
+        }
+
+        bool operator==(counted const &other) const
+        {
+            return value == other.value;
+        }
+    };
+
+    std::atomic<int> counted::live(0);
+
+    void test_clear()
+    {
+        {
+            insertion_ordered_map<int, counted> m;
+            for (int i = 0; i < 1000; ++i)
+                m.insert(i, i);
+
+            // a copy keeps the shared entries
+            insertion_ordered_map<int, counted> copy(m);
+            m.clear();
+            assert(m.empty() && !m.contains(0) && m.begin() == m.end());
+            assert(copy.size() == 1000 && std::as_const(copy).at(999).value == 999);
+            assert(counted::live == 1000);
+
+            m.insert(1, 1);
+            assert(m.size() == 1 && std::as_const(m).at(1).value == 1);
+
+            // the last owner destroys the entries at once
+            copy.clear();
+            assert(counted::live == 1);
+
+            m.clear();
+            m.clear();
+            assert(m.empty() && counted::live == 0);
+        }
+
+        insertion_ordered_map<int, counted> m;
+        for (int i = 0; i < 1000; ++i)
+            m.insert(i, i);
+        m.clear_in_background();
+        assert(m.empty());
+        m.insert(5, 5);
+        assert(m.size() == 1 && std::as_const(m).at(5).value == 5);
+
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        while (counted::live != 1 && std::chrono::steady_clock::now() < deadline)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        assert(counted::live == 1);
+    }
+
+    template <class F>
+    bool throws_lookup_error(F f)
+    {
+        try {
+            f();
+        }
+        catch (lookup_error const &) {
+            return true;
+        }
+        return false;
+    }
+
+    void test_moves()
+    {
+        insertion_ordered_map<int, std::string> m;
+        model<int, std::string> expected;
+        for (int i = 0; i < 100; ++i) {
+            m.insert(i, std::to_string(i));
+            expected.insert(i, std::to_string(i));
+        }
+        insertion_ordered_map<int, std::string> copy(m);
+        auto copied = expected.entries;
+
+        // moving to the front over and over makes room there again and again
+        for (int round = 0; round < 5; ++round) {
+            for (int i = 0; i < 99; i += 3) {
+                m.move_to_front(i);
+                expected.move_to_front(i);
+                m.move_to_back(i + 1);
+                expected.move_to_back(i + 1);
+            }
+        }
+        assert(entries(m) == expected.entries);
+        assert(entries(copy) == copied);
+
+        // the first and last entries stay
+        m.move_to_front(expected.entries.front().first);
+        m.move_to_back(expected.entries.back().first);
+        assert(entries(m) == expected.entries);
+
+        assert(throws_lookup_error([&m] { m.move_to_back(100); }));
+        assert(throws_lookup_error([&m] { m.move_to_front(-1); }));
+        assert(entries(m) == expected.entries);
+
+        // free numbers in front are made a few pages per operation ahead
+        // of time, so no move to the front renumbers the map at once, not
+        // even the first one after appending
+        int const appended = 100000, moved = 20000;
+        insertion_ordered_map<int, int> large;
+        for (int i = 0; i < appended; ++i)
+            large.insert(i, i);
+        size_t most = 0;
+        for (int i = 0; i < moved; ++i) {
+            size_t before = allocations;
+            large.move_to_front(appended - 1 - i);
+            most = std::max(most, allocations - before);
+            large.insert(appended + i, i);
+        }
+        assert(most <= 16);
+
+        std::vector<int> order;
+        for (auto it = large.begin(), end = large.end(); it != end; ++it)
+            order.push_back((*it).first);
+        std::vector<int> expected_order;
+        for (int i = appended - moved; i < appended; ++i)
+            expected_order.push_back(i);
+        for (int i = 0; i < appended - moved; ++i)
+            expected_order.push_back(i);
+        for (int i = appended; i < appended + moved; ++i)
+            expected_order.push_back(i);
+        assert(order == expected_order);
+    }
+
+    // nth() and position_of() agree with the model as entries come and go.
+    void test_positions()
+    {
+        std::mt19937 random(33);
+        for (int keys : {6, 2000}) {
+            insertion_ordered_map<int, int> m;
+            model<int, int> expected;
+
+            for (int op = 0; op < 4000; ++op) {
+                int k = random() % keys;
+                if (random() % 3 == 0 && expected.contains(k)) {
+                    m.erase(k);
+                    expected.erase(k);
+                }
+                else if (random() % 4 == 0 && expected.contains(k)) {
+                    m.move_to_front(k);
+                    expected.move_to_front(k);
+                }
+                else {
+                    m.insert(k, op);
+                    expected.insert(k, op);
+                }
+
+                if (op % 100 != 0) continue;
+
+                size_t size = expected.entries.size();
+                for (size_t i = 0; i < size; i += 1 + size / 50) {
+                    int key = expected.entries[i].first;
+                    assert((*m.nth(i)).first == key && (*m.nth(i)).second == expected.entries[i].second);
+                    assert(m.position_of(key) == i);
+                }
+                assert(m.nth(size) == m.end() && m.nth(size + 10) == m.end());
+                assert(throws_lookup_error([&m, keys] { m.position_of(keys); }));
+            }
+        }
+    }
+
+    void test_bulk_erase()
+    {
+        std::mt19937 random(34);
+        for (int round = 0; round < 200; ++round) {
+            insertion_ordered_map<int, int> m;
+            model<int, int> expected;
+            int n = random() % 600;
+            for (int i = 0; i < n; ++i) {
+                int k = random() % 1000;
+                m.insert(k, i);
+                expected.insert(k, i);
+            }
+
+            // sometimes shared, so that the erasures copy what they write
+            insertion_ordered_map<int, int> copy;
+            if (round % 2 == 0)
+                copy = m;
+            auto copied = entries(copy);
+
+            size_t size = expected.entries.size();
+            size_t first = size == 0 ? 0 : random() % size;
+            size_t last = first + (size == 0 ? 0 : random() % (size - first + 1));
+            m.erase(m.nth(first), m.nth(last));
+            expected.entries.erase(expected.entries.begin() + first, expected.entries.begin() + last);
+            assert(entries(m) == expected.entries);
+
+            size_t prefix = random() % 50;
+            size_t erased = std::min(prefix, expected.entries.size());
+            assert(m.erase_prefix(prefix) == erased);
+            expected.entries.erase(expected.entries.begin(), expected.entries.begin() + erased);
+            assert(entries(m) == expected.entries);
+
+            int divisor = 1 + random() % 5;
+            auto doomed = [divisor](int k, int) { return k % divisor == 0; };
+            size_t before = expected.entries.size();
+            expected.entries.erase(std::remove_if(expected.entries.begin(), expected.entries.end(),
+                                                  [&doomed](auto const &e) { return doomed(e.first, e.second); }),
+                                   expected.entries.end());
+            assert(m.erase_if(doomed) == before - expected.entries.size());
+            assert(entries(m) == expected.entries);
+            assert(m.size() == expected.entries.size());
+            assert(entries(copy) == copied);
+
+            for (auto const &e : expected.entries)
+                assert(m.contains(e.first));
+            m.insert(-1, -1);
+            expected.insert(-1, -1);
+            assert(entries(m) == expected.entries);
+        }
+
+        // a throwing predicate erases nothing
+        insertion_ordered_map<int, int> m;
+        for (int i = 0; i < 100; ++i)
+            m.insert(i, i);
+        auto before = entries(m);
+        bool thrown = false;
+        try {
+            m.erase_if([](int k, int) {
+                if (k == 50) throw std::runtime_error("pred");
+                return true;
+            });
+        }
+        catch (std::runtime_error const &) {
+            thrown = true;
+        }
+        assert(thrown && entries(m) == before);
+
+        // nor does a failed allocation, whether a few entries are erased
+        // key by key or most of them by rebuilding the index, and the box
+        // of a value given out by reference is kept
+        for (int kept : {99, 1}) {
+            for (size_t fail = 0;; ++fail) {
+                insertion_ordered_map<int, int> shared;
+                for (int i = 0; i < 1000; ++i)
+                    shared.insert(i, i);
+                int &held = shared.at(999);
+                insertion_ordered_map<int, int> copy(shared);
+                auto before = entries(shared);
+
+                allocation_limit = allocations + fail;
+                bool failed = false;
+                try {
+                    shared.erase_if([kept](int k, int) { return k % 100 >= kept; });
+                }
+                catch (std::bad_alloc const &) {
+                    failed = true;
+                }
+                allocation_limit = ~size_t(0);
+
+                assert(entries(copy) == before);
+                if (failed) {
+                    assert(entries(shared) == before);
+                    held = -999;
+                    assert(shared.at(999) == -999 && copy.at(999) == 999);
+                    continue;
+                }
+                assert(shared.size() == 10 * size_t(kept) && !shared.contains(999));
+                break;
+            }
+        }
+    }
+
+    // step() copies what a copy shares a few pages at a time.
+    void test_step()
+    {
+        insertion_ordered_map<int, std::string> m;
+        for (int i = 0; i < 5000; ++i)
+            m.insert(i, std::to_string(i));
+        assert(m.step(1));
+
+        insertion_ordered_map<int, std::string> copy(m);
+
+        int steps = 0;
+        while (!copy.step(4)) {
+            ++steps;
+            if (steps % 10 == 0) {
+                copy.update(steps, [](std::string &v) { v += "!"; });
+                m.erase(steps + 1);
+            }
+        }
+        assert(steps > 10);
+        assert(copy.step(4));
+
+        // neither sees the changes of the other
+        for (int i = 0; i < 5000; ++i) {
+            bool changed = i % 10 == 0 && i > 0 && i <= steps;
+            assert(std::as_const(copy).at(i) == std::to_string(i) + (changed ? "!" : ""));
+            assert(m.contains(i) == (i % 10 != 1 || i == 1 || i > steps + 1));
+        }
+        m.insert(-1, "");
+        copy.erase(0);
+        assert(copy.size() == 4999 && !copy.contains(-1) && m.contains(-1));
+
+        insertion_ordered_map<int, int> small;
+        small.insert(1, 1);
+        insertion_ordered_map<int, int> small_copy(small);
+        assert(small_copy.step(1) && small.step(1));
+    }
+
+    // Checks diff(from, to) against their entries.
+    template <class Map>
+    void check_diff(Map const &from, Map const &to, size_t moves)
+    {
+        auto changes = Map::diff(from, to);
+        auto before = entries(from);
+        auto after = entries(to);
+
+        auto find = [](auto const &list, int k) {
+            return std::find_if(list.begin(), list.end(), [k](auto const &e) { return e.first == k; });
+        };
+
+        std::vector<int> inserted, erased, changed;
+        for (auto const &e : after) {
+            auto old = find(before, e.first);
+            if (old == before.end())
+                inserted.push_back(e.first);
+            else if (old->second != e.second)
+                changed.push_back(e.first);
+        }
+        for (auto const &e : before) {
+            if (find(after, e.first) == after.end())
+                erased.push_back(e.first);
+        }
+        assert(changes.inserted == inserted);
+        assert(changes.erased == erased);
+        assert(changes.changed == changed);
+
+        // the keys in both that were not reordered keep their relative order
+        auto kept = [&](auto const &list, auto const &other) {
+            std::vector<int> result;
+            for (auto const &e : list) {
+                if (find(other, e.first) != other.end()
+                    && std::find(changes.reordered.begin(), changes.reordered.end(), e.first) == changes.reordered.end())
+                    result.push_back(e.first);
+            }
+            return result;
+        };
+        assert(kept(before, after) == kept(after, before));
+        assert(changes.reordered.size() <= moves);
+        for (int k : changes.reordered)
+            assert(find(before, k) != before.end() && find(after, k) != after.end());
+    }
+
+    void test_diff()
+    {
+        std::mt19937 random(37);
+        for (int round = 0; round < 100; ++round) {
+            insertion_ordered_map<int, int> base;
+            int n = round % 10 == 0 ? 5 : 1 + random() % 1000;
+            for (int i = 0; i < n; ++i)
+                base.insert(random() % 2000, i);
+
+            // a modified copy, then a map built apart with the same entries
+            insertion_ordered_map<int, int> modified(base);
+            size_t moves = 0;
+            int ops = random() % 50;
+            for (int op = 0; op < ops; ++op) {
+                int k = random() % 2000;
+                switch (random() % 5) {
+                case 0:
+                    moves += !modified.insert(k, op);
+                    break;
+                case 1:
+                    if (modified.contains(k))
+                        modified.erase(k);
+                    break;
+                case 2:
+                    if (modified.contains(k))
+                        modified.update(k, [op](int &v) { v = -op; });
+                    break;
+                case 3:
+                    if (modified.contains(k)) {
+                        modified.move_to_back(k);
+                        moves++;
+                    }
+                    break;
+                case 4:
+                    if (modified.contains(k)) {
+                        modified.move_to_front(k);
+                        moves++;
+                    }
+                    break;
+                }
+            }
+            check_diff(base, modified, moves);
+            check_diff(modified, base, moves);
+
+            insertion_ordered_map<int, int> rebuilt;
+            for (auto const &e : entries(modified))
+                rebuilt.insert(e.first, e.second);
+            check_diff(base, rebuilt, moves);
+            check_diff(rebuilt, modified, 0);
+            check_diff(modified, modified, 0);
+        }
+    }
+
+    // Reads up to limit entries from c, in batches of up to 100.
+    template <class Cursor>
+    std::vector<std::pair<int, int>> read(Cursor &c, size_t limit)
+    {
+        std::vector<std::pair<int, int>> result;
+        std::vector<typename Cursor::span> batch;
+        while (result.size() < limit && c.next(batch, std::min<size_t>(100, limit - result.size())) > 0) {
+            for (auto const &s : batch) {
+                for (size_t i = 0; i < s.count; ++i)
+                    result.emplace_back(s.keys[i], s.values[i]);
+            }
+        }
+        return result;
+    }
+
+    void test_cursors()
+    {
+        using map = insertion_ordered_map<int, int>;
+        using cursor = map::cursor;
+        size_t const all = ~size_t(0);
+
+        map m;
+        for (int i = 0; i < 1000; ++i)
+            m.insert(i, i);
+        m.at(400) = -400;   // a value read from its box
+        m.erase(0);
+        auto original = entries(m);
+
+        cursor c(m);
+        auto first = read(c, 300);
+        assert(first.size() == 300);
+        assert(std::equal(first.begin(), first.end(), original.begin()));
+        cursor::token t = c.position();
+
+        for (int i = 1000; i < 1010; ++i)
+            m.insert(i, i);
+        m.erase(100);
+        m.erase(700);
+        m.move_to_back(50);
+        m.move_to_back(800);
+        m.move_to_front(900);
+        m.update(600, [](int &v) { v = -600; });
+
+        // the snapshot does not change
+        auto rest = read(c, all);
+        assert(std::equal(rest.begin(), rest.end(), original.begin() + 300) && rest.size() == 699);
+        assert(read(c, all).empty());
+
+        // the later version goes on with what is unread, added or moved to the back
+        std::vector<std::pair<int, int>> expected;
+        for (int i = 301; i < 1000; ++i) {
+            if (i != 700 && i != 800 && i != 900)
+                expected.emplace_back(i, i == 400 || i == 600 ? -i : i);
+        }
+        for (int i = 1000; i < 1010; ++i)
+            expected.emplace_back(i, i);
+        expected.emplace_back(50, 50);
+        expected.emplace_back(800, 800);
+
+        cursor resumed(m, t);
+        assert(read(resumed, all) == expected);
+
+        // compaction renumbers the entries
+        for (int i = 0; i < 1000; ++i) {
+            if (m.contains(i) && i % 50 != 0)
+                m.erase(i);
+        }
+        for (int i = 2000; i < 2100; ++i)
+            m.insert(i, i);
+        assert(throws_lookup_error([&m, t] { cursor(m, t); }));
+
+        // inline entries are read by index
+        map small;
+        for (int i = 0; i < 5; ++i)
+            small.insert(i, i * 10);
+        cursor s(small);
+        assert((read(s, 2) == std::vector<std::pair<int, int>>{{0, 0}, {1, 10}}));
+        cursor small_resumed(small, s.position());
+        assert((read(small_resumed, all) == std::vector<std::pair<int, int>>{{2, 20}, {3, 30}, {4, 40}}));
+
+        map empty;
+        cursor e(empty);
+        assert(read(e, all).empty());
+    }
+
+    struct same_hash {
+        size_t operator()(int) const noexcept
+        {
+            return 42;
+        }
+    };
+
+    // Keys and values are stored in separate columns, which a cursor reads
+    // in runs of consecutive live entries, and the index keeps only a
+    // fragment of each hash.
+    void test_columns()
+    {
+        using map = insertion_ordered_map<std::uint64_t, double>;
+        using cursor = map::cursor;
+
+        // a run ends within its page of 64 entries, so appended entries
+        // come in few runs
+        map m;
+        for (std::uint64_t i = 0; i < 6400; ++i)
+            m.insert(i * 3, i * 0.5);
+        std::vector<cursor::span> spans;
+        cursor appended(m);
+        assert(appended.next(spans, 6400) == 6400 && spans.size() <= 6400 / 64 + 2);
+
+        for (std::uint64_t i = 0; i < 6400; i += 7)
+            m.erase(i * 3);
+        for (std::uint64_t i = 1; i < 6400; i += 98)
+            m.move_to_back(i * 3);
+        m.at(6) = -1.0;     // a value given out by reference
+        auto expected = entries(m);
+        double expected_sum = 0;
+        for (auto const &e : expected)
+            expected_sum += e.second;
+
+        cursor c(m);
+        size_t at = 0;
+        double sum = 0;
+        while (size_t count = c.next(spans, 1000)) {
+            size_t in_spans = 0;
+            for (auto const &span : spans) {
+                assert(span.count > 0 && span.count <= 64);
+                for (size_t i = 0; i < span.count; ++i, ++at)
+                    assert(span.keys[i] == expected[at].first && span.values[i] == expected[at].second);
+                sum = std::accumulate(span.values, span.values + span.count, sum);
+                in_spans += span.count;
+            }
+            assert(count == in_spans && count <= 1000);
+        }
+        assert(at == expected.size() && sum == expected_sum);
+
+        // keys whose hashes are all equal are told apart by comparing them
+        insertion_ordered_map<int, int, same_hash> colliding;
+        for (int i = 0; i < 500; ++i)
+            colliding.insert(i, -i);
+        for (int i = 0; i < 500; i += 2)
+            colliding.erase(i);
+        for (int i = 0; i < 500; ++i)
+            assert(colliding.contains(i) == (i % 2 == 1) && (i % 2 == 0 || colliding.at(i) == -i));
+        assert(colliding.size() == 250 && !colliding.contains(500));
+    }
+
+    void test_checkpoints()
+    {
+        std::string path = "insertion_ordered_map_test.checkpoint";
+        insertion_ordered_map<int, std::string> m;
+        for (int i = 0; i < 20000; ++i)
+            m.insert(i, std::to_string(i));
+        auto saved_entries = entries(m);
+
+        // the map is changed while the checkpoint is written
+        auto done = m.checkpoint_async(path);
+        for (int i = 0; i < 20000; i += 2)
+            m.erase(i);
+        m.update(1, [](std::string &v) { v = "changed"; });
+        m.insert(-1, "added");
+        done.get();
+
+        insertion_ordered_map<int, std::string> loaded;
+        loaded.load(path);
+        assert(entries(loaded) == saved_entries);
+        assert(m.size() == 10001 && std::as_const(m).at(1) == "changed");
+
+        // checkpoints run in order, each replacing the last
+        auto first = m.checkpoint_async(path);
+        m.clear();
+        auto second = m.checkpoint_async(path);
+        first.get();
+        second.get();
+        loaded.load(path);
+        assert(loaded.empty());
+        std::remove(path.c_str());
+
+        bool failed = false;
+        try {
+            m.checkpoint_async("no such directory/checkpoint").get();
+        }
+        catch (serialization_error const &) {
+            failed = true;
+        }
+        assert(failed);
+    }
+
+    void test_update()
+    {
+        for (int n : {5, 10000}) {
+            insertion_ordered_map<int, std::string> m;
+            model<int, std::string> expected;
+            for (int i = 0; i < n; ++i) {
+                m.insert(i, std::to_string(i));
+                expected.insert(i, std::to_string(i));
+            }
+
+            // neither moves a present key
+            m.update(2, [](std::string &v) { v += "+"; });
+            expected.find(2)->second += "+";
+            assert(!m.upsert(3, [] { return std::string("made"); }, [](std::string &v) { v = "fn"; }));
+            expected.find(3)->second = "fn";
+            assert(m.upsert(-1, [] { return std::string("made"); }, [](std::string &v) { v = "fn"; }));
+            expected.insert(-1, "made");
+            assert(entries(m) == expected.entries);
+
+            assert(throws_lookup_error([&m] { m.update(-2, [](std::string &) {}); }));
+
+            // a throwing fn leaves the value as it left it
+            bool thrown = false;
+            try {
+                m.update(4, [](std::string &v) {
+                    v = "partial";
+                    throw std::runtime_error("fn");
+                });
+            }
+            catch (std::runtime_error const &) {
+                thrown = true;
+            }
+            expected.find(4)->second = "partial";
+            assert(thrown && entries(m) == expected.entries);
+        }
+
+        // copying after update() shares pages, unlike after at()
+        insertion_ordered_map<int, int> updated, referenced;
+        for (int i = 0; i < 10000; ++i) {
+            updated.insert(i, i);
+            referenced.insert(i, i);
+        }
+        updated.update(5, [](int &v) { v = -5; });
+        referenced.at(5) = -5;
+
+        size_t before = allocations;
+        insertion_ordered_map<int, int> cheap(updated);
+        cheap.update(6, [](int &v) { v = -6; });
+        size_t cheap_allocations = allocations - before;
+
+        before = allocations;
+        insertion_ordered_map<int, int> full(referenced);
+        size_t full_allocations = allocations - before;
+
+        assert(cheap_allocations < 20 && full_allocations > 100);
+        assert(std::as_const(updated).at(6) == 6 && std::as_const(cheap).at(6) == -6);
+        assert(std::as_const(full).at(5) == -5);
+    }
+
+    // Runs random batches that commit, abort or throw, against the model.
+    void test_batches()
+    {
+        std::mt19937 random(44);
+        for (int keys : {12, 3000}) {
+            insertion_ordered_map<int, std::string> m;
+            model<int, std::string> expected;
+            for (int i = 0; i < keys / 2; ++i) {
+                m.insert(i, std::to_string(i));
+                expected.insert(i, std::to_string(i));
+            }
+
+            for (int round = 0; round < 300; ++round) {
+                insertion_ordered_map<int, std::string> copy(m);
+                auto copied = expected.entries;
+                model<int, std::string> changed = expected;
+                int ending = random() % 3;
+                int ops = random() % 40;
+
+                auto run = [&](auto &batch) {
+                    for (int op = 0; op < ops; ++op) {
+                        int k = random() % keys;
+                        std::string v = std::to_string(round) + "." + std::to_string(op);
+
+                        switch (random() % 3) {
+                        case 0:
+                            assert(batch.insert(k, v) == changed.insert(k, v));
+                            break;
+                        case 1:
+                            if (changed.contains(k)) {
+                                batch.erase(k);
+                                changed.erase(k);
+                            }
+                            break;
+                        case 2:
+                            batch.assign(k, v);
+                            if (changed.contains(k))
+                                changed.find(k)->second = v;
+                            else
+                                changed.insert(k, v);
+                            break;
+                        }
+                        assert(batch.contains(k) == changed.contains(k));
+                        assert(batch.size() == changed.entries.size());
+                    }
+
+                    if (ending == 1)
+                        batch.abort();
+                    else if (ending == 2)
+                        throw std::runtime_error("batch");
+                };
+
+                bool kept = false, thrown = false;
+                try {
+                    kept = m.batch(run);
+                }
+                catch (std::runtime_error const &) {
+                    thrown = true;
+                }
+                assert(kept == (ending == 0) && thrown == (ending == 2));
+                if (kept)
+                    expected = changed;
+
+                assert(entries(m) == expected.entries);
+                assert(entries(copy) == copied);
+                for (size_t i = 0; i < expected.entries.size(); i += 1 + expected.entries.size() / 20) {
+                    assert(m.position_of(expected.entries[i].first) == i);
+                    assert(std::as_const(m).at(expected.entries[i].first) == expected.entries[i].second);
+                }
+            }
+        }
+    }
+    template <class K, class V, class Hash>
+    void check_set_algebra(insertion_ordered_map<K, V, Hash> const &a, insertion_ordered_map<K, V, Hash> const &b)
+    {
+        using map = insertion_ordered_map<K, V, Hash>;
+        std::vector<std::pair<K, V>> both, only_a, united = entries(a);
+        for (auto const &e : entries(a))
+            (b.contains(e.first) ? both : only_a).push_back(e);
+        for (auto const &e : entries(b)) {
+            if (!a.contains(e.first))
+                united.push_back(e);
+        }
+
+        assert(entries(map::intersect(a, b)) == both);
+        assert(entries(map::difference(a, b)) == only_a);
+        assert(entries(map::unite(a, b)) == united);
+    }
+
+    // Checks intersect, difference and unite against the model, on maps of
+    // every size, with gaps, and sharing their data or pages.
+    void test_set_algebra()
+    {
+        std::mt19937 random(45);
+        for (int a_size : {0, 3, 8, 9, 200, 5000}) {
+            for (int b_size : {0, 5, 9, 300, 4000}) {
+                insertion_ordered_map<int, int> a, b;
+                int range = 2 * std::max({a_size, b_size, 1});
+                while (a.size() < static_cast<size_t>(a_size))
+                    a.insert(random() % range, 1);
+                while (b.size() < static_cast<size_t>(b_size))
+                    b.insert(random() % range, 2);
+                check_set_algebra(a, b);
+
+                // gaps left by erased entries, and moved entries
+                for (int i = 0; i < a_size / 4; ++i) {
+                    int k = random() % range;
+                    if (a.contains(k))
+                        a.erase(k);
+                    k = random() % range;
+                    if (a.contains(k))
+                        a.move_to_back(k);
+                }
+                check_set_algebra(a, b);
+                check_set_algebra(b, a);
+            }
+        }
+
+        using int_map = insertion_ordered_map<int, int>;
+        int_map m;
+        for (int i = 0; i < 10000; ++i)
+            m.insert(i, i);
+
+        // identical maps, which share their data
+        int_map same(m);
+        check_set_algebra(m, same);
+        assert(int_map::intersect(m, same).size() == 10000);
+        assert(int_map::difference(m, same).empty());
+
+        // a modified copy, which shares most pages
+        int_map changed(m);
+        for (int i = 0; i < 10000; i += 97)
+            changed.erase(i);
+        for (int i = 10000; i < 10050; ++i)
+            changed.insert(i, i);
+        changed.move_to_back(500);
+        check_set_algebra(m, changed);
+        check_set_algebra(changed, m);
+
+        // string keys, whose hashes come from a stateless std::hash
+        insertion_ordered_map<std::string, int, std::hash<std::string>> s, t;
+        for (int i = 0; i < 1000; ++i) {
+            s.insert(std::to_string(random() % 1500), i);
+            t.insert(std::to_string(random() % 1500), -i);
+        }
+        check_set_algebra(s, t);
+        check_set_algebra(t, s);
+    }
+    template <class View>
+    std::vector<std::pair<int, int>> view_entries(View const &view, typename View::iterator it)
+    {
+        std::vector<std::pair<int, int>> result;
+        for (auto end = view.end(); it != end; ++it)
+            result.emplace_back((*it).first, (*it).second);
+        return result;
+    }
+
+    // Checks a view made by by_key() against the sorted entries, and its
+    // bounds on keys present, absent, and past either end.
+    template <class View>
+    void check_key_order(View const &view, std::map<int, int> const &sorted, int range)
+    {
+        std::vector<std::pair<int, int>> all(sorted.begin(), sorted.end());
+        assert(view.size() == sorted.size());
+        assert(view_entries(view, view.begin()) == all);
+
+        for (int k = -1; k <= range; k += 1 + range / 20) {
+            std::vector<std::pair<int, int>> at_least(sorted.lower_bound(k), sorted.end());
+            std::vector<std::pair<int, int>> above(sorted.upper_bound(k), sorted.end());
+            assert(view_entries(view, view.lower_bound(k)) == at_least);
+            assert(view_entries(view, view.upper_bound(k)) == above);
+        }
+    }
+
+    // Runs random operations, on inline and paged maps, and checks by_key()
+    // after each few; views made earlier keep showing the entries they had.
+    void test_key_order()
+    {
+        std::mt19937 random(47);
+        for (int range : {6, 12, 5000}) {
+            insertion_ordered_map<int, int> m;
+            model<int, int> expected;
+            auto sorted = [&expected] {
+                return std::map<int, int>(expected.entries.begin(), expected.entries.end());
+            };
+
+            check_key_order(m.by_key(), sorted(), range);
+
+            auto old_view = m.by_key();
+            std::map<int, int> old_sorted;
+            for (int op = 0; op < 10000; ++op) {
+                int k = random() % range;
+                int v = random() % 1000;
+                bool present = expected.contains(k);
+
+                switch (random() % 6) {
+                case 0:
+                case 1:
+                    assert(m.insert(k, v) == expected.insert(k, v));
+                    break;
+                case 2:
+                    if (present) {
+                        m.erase(k);
+                        expected.erase(k);
+                    }
+                    break;
+                case 3:
+                    if (present) {
+                        m.move_to_back(k);
+                        expected.move_to_back(k);
+                    }
+                    break;
+                case 4:
+                    if (present) {
+                        m.move_to_front(k);
+                        expected.move_to_front(k);
+                    }
+                    break;
+                case 5:
+                    if (present) {
+                        m.update(k, [v](int &value) { value = v; });
+                        expected.find(k)->second = v;
+                    }
+                    break;
+                }
+
+                if (op % 200 == 0) {
+                    check_key_order(m.by_key(), sorted(), range);
+                    check_key_order(old_view, old_sorted, range);
+                }
+                if (op % 1000 == 0) {
+                    old_view = m.by_key();
+                    old_sorted = sorted();
+                }
+            }
+            check_key_order(m.by_key(), sorted(), range);
+            check_key_order(old_view, old_sorted, range);
+
+            // keys erased since the last call are left out
+            for (int i = 0; i < range; i += 2) {
+                if (expected.contains(i)) {
+                    m.erase(i);
+                    expected.erase(i);
+                }
+            }
+            check_key_order(m.by_key(), sorted(), range);
+            check_key_order(old_view, old_sorted, range);
+        }
+    }
+}
+
+int main()
+{
+    test_serialization();
+    test_small_maps();
+    test_references();
+    test_held_references();
+    test_hash();
+    test_identity_hash();
+    test_compaction();
+    test_clear();
+    test_moves();
+    test_positions();
+    test_bulk_erase();
+    test_step();
+    test_diff();
+    test_cursors();
+    test_columns();
+    test_checkpoints();
+    test_update();
+    test_batches();
+    test_set_algebra();
+    test_key_order();
+
+    return 0;
+}
@@ -0,0 +1,254 @@
+#ifndef _INTERNED_INSERTION_ORDERED_MAP_H
+#define _INTERNED_INSERTION_ORDERED_MAP_H
+
+#include "insertion_ordered_map.h"
+
+#include <string_view>
+
+/*
+ * Append-only storage for the characters of interned keys. Chunks are
+ * shared between copies of a map, and only a chunk owned by a single map is
+ * appended to, so copies never write to memory they share. Chunks start
+ * small and double, so a map or copy holding a few keys stays small.
+ */
+class iom_string_arena {
+private:
+    static constexpr size_t first_chunk = 256;
+    static constexpr size_t max_chunk = 64 * 1024;
+
+    struct chunk {
+        std::unique_ptr<char[]> chars;
+        size_t used;
+        size_t capacity;
+
+        explicit chunk(size_t capacity) :
+                chars(new char[capacity]),
+                used(0),
+                capacity(capacity) {}
+    };
+
+    std::vector<std::shared_ptr<chunk>> chunks;
+    size_t next_chunk;  // capacity of the next chunk opened
+
+public:
+
+    iom_string_arena() :
+            chunks(),
+            next_chunk(first_chunk) {}
+
+    // The copy opens its own chunks from the smallest size again.
+    iom_string_arena(iom_string_arena const &other) :
+            chunks(other.chunks),
+            next_chunk(first_chunk) {}
+
+    iom_string_arena(iom_string_arena &&other) = default;
+
+    iom_string_arena &operator=(iom_string_arena const &other) {
+        chunks = other.chunks;
+        next_chunk = first_chunk;
+        return *this;
+    }
+
+    iom_string_arena &operator=(iom_string_arena &&other) = default;
+
+    // Copies s into the arena; the copy stays put as long as the arena.
+    char const *store(std::string_view s) { // strong
+        bool open = !chunks.empty() && chunks.back().use_count() == 1
+                    && chunks.back()->capacity - chunks.back()->used >= s.size();
+
+        if(!open) {
+            chunks.reserve(chunks.size() + 1);
+            chunks.push_back(std::make_shared<chunk>(std::max(next_chunk, s.size())));
+            next_chunk = std::min(2 * next_chunk, max_chunk);
+        }
+
+        chunk &tail = *chunks.back();
+        char *stored = tail.chars.get() + tail.used;
+        if(!s.empty())
+            std::memcpy(stored, s.data(), s.size());
+        tail.used += s.size();
+
+        return stored;
+    }
+};
+
+/*
+ * A string key as stored in an iom_string_arena: 16 bytes referring to the
+ * characters, with their hash cached, so that keys are compared by hash and
+ * memcmp. Constructed from a string_view, it refers to the caller's
+ * characters and serves for lookups.
+ */
+class iom_interned_key {
+private:
+    char const *chars;
+    std::uint32_t length;
+    std::uint32_t hash_value;
+
+public:
+
+    iom_interned_key(std::string_view s) :
+            chars(s.data()),
+            length(static_cast<std::uint32_t>(s.size())),
+            hash_value(static_cast<std::uint32_t>(iom_hash<std::string_view>()(s))) {}
+
+    // The key of like, with its characters at chars.
+    iom_interned_key(char const *chars, iom_interned_key const &like) :
+            chars(chars),
+            length(like.length),
+            hash_value(like.hash_value) {}
+
+    std::string_view view() const noexcept {
+        return std::string_view(chars, length);
+    }
+
+    operator std::string_view() const noexcept {
+        return view();
+    }
+
+    size_t hash() const noexcept {
+        return hash_value;
+    }
+
+    bool operator==(iom_interned_key const &other) const noexcept {
+        return hash_value == other.hash_value && length == other.length
+               && (length == 0 || std::memcmp(chars, other.chars, length) == 0);
+    }
+};
+
+struct iom_interned_key_hash {
+    size_t operator()(iom_interned_key const &k) const noexcept {
+        return k.hash();
+    }
+};
+
+/*
+ * insertion_ordered_map with string keys interned into an arena shared by
+ * its copies: each key is stored once, and entries, the index and the set
+ * of keys with references given out hold 16-byte iom_interned_keys.
+ *
+ * Erased keys leave their characters behind; once they outweigh the live
+ * ones, an insertion rebuilds the map into a fresh arena, which also
+ * invalidates references to values.
+ */
+template <class V>
+class interned_insertion_ordered_map {
+public:
+    using key_type = iom_interned_key;
+    using map_type = insertion_ordered_map<iom_interned_key, V, iom_interned_key_hash>;
+    using iterator = typename map_type::iterator;
+
+private:
+    static constexpr size_t min_reclaimed = 64 * 1024;
+
+    iom_string_arena arena;
+    map_type map;
+    size_t live_bytes;
+    size_t garbage_bytes;
+
+    void reclaim() { // strong
+        interned_insertion_ordered_map rebuilt;
+        for(auto it = map.begin(), end = map.end(); it != end; ++it)
+            rebuilt.insert((*it).first, (*it).second);
+
+        *this = std::move(rebuilt);
+    }
+
+    // The key as stored in the map, which has to contain it.
+    iom_interned_key const &stored(iom_interned_key const &k) const {
+        return (*map.nth(map.position_of(k))).first;
+    }
+
+public:
+
+    interned_insertion_ordered_map() :
+            arena(),
+            map(),
+            live_bytes(0),
+            garbage_bytes(0) {}
+
+    // Same as insertion_ordered_map::insert.
+    bool insert(std::string_view k, V const &v) {
+        iom_interned_key probe(k);
+        if(map.contains(probe)) {
+            map.move_to_back(probe);
+            return false;
+        }
+
+        if(garbage_bytes > live_bytes && garbage_bytes > min_reclaimed)
+            reclaim();
+
+        map.insert(iom_interned_key(arena.store(k), probe), v);
+        live_bytes += k.size();
+        return true;
+    }
+
+    void erase(std::string_view k) {
+        map.erase(iom_interned_key(k));
+
+        live_bytes -= k.size();
+        garbage_bytes += k.size();
+    }
+
+    void move_to_back(std::string_view k) {
+        map.move_to_back(iom_interned_key(k));
+    }
+
+    void move_to_front(std::string_view k) {
+        map.move_to_front(iom_interned_key(k));
+    }
+
+    void pop_front() {
+        size_t freed = map.empty() ? 0 : (*map.begin()).first.view().size();
+        map.pop_front();
+
+        live_bytes -= freed;
+        garbage_bytes += freed;
+    }
+
+    // The map remembers the key of a reference, so it is given the copy in
+    // the arena rather than the caller's characters.
+    V &at(std::string_view k) {
+        iom_interned_key key = stored(iom_interned_key(k));
+        return map.at(key);
+    }
+
+    V const &at(std::string_view k) const {
+        return map.at(iom_interned_key(k));
+    }
+
+    bool contains(std::string_view k) const {
+        return map.contains(iom_interned_key(k));
+    }
+
+    size_t size() const noexcept {
+        return map.size();
+    }
+
+    bool empty() const noexcept {
+        return map.empty();
+    }
+
+    void clear() noexcept {
+        map.clear();
+        arena = iom_string_arena();
+        live_bytes = 0;
+        garbage_bytes = 0;
+    }
+
+    // Characters of the keys, and of erased keys not yet reclaimed.
+    size_t key_bytes() const noexcept {
+        return live_bytes + garbage_bytes;
+    }
+
+    // Iterators //
+
+    iterator begin() const {
+        return map.begin();
+    }
+
+    iterator end() const {
+        return map.end();
+    }
+};
+
+#endif
@@ -0,0 +1,180 @@
+// Tests of interned_insertion_ordered_map.h. Build and run with
+//     g++ -std=c++17 -pthread -fsanitize=address,undefined interned_insertion_ordered_map_test.cpp && ./a.out
+
+#include "interned_insertion_ordered_map.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+    size_t allocated_bytes = 0;
+}
+
+// Replaced allocation functions are kept out of line, so that GCC never
+// sees an inlined std::free paired with a call to operator new.
+[[gnu::noinline]] void *operator new(size_t size)
+{
+    allocated_bytes += size;
+    if (void *p = std::malloc(size))
+        return p;
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void *operator new[](size_t size)
+{
+    allocated_bytes += size;
+    if (void *p = std::malloc(size))
+        return p;
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+[[gnu::noinline]] void operator delete(void *p, size_t) noexcept
+{
+    std::free(p);
+}
+
+[[gnu::noinline]] void operator delete[](void *p) noexcept
+{
+    std::free(p);
+}
+
+[[gnu::noinline]] void operator delete[](void *p, size_t) noexcept
+{
+    std::free(p);
+}
+
+namespace {
+    using interned = interned_insertion_ordered_map<int>;
+
+    std::vector<std::pair<std::string, int>> entries(interned const &m)
+    {
+        std::vector<std::pair<std::string, int>> result;
+        for (auto it = m.begin(), end = m.end(); it != end; ++it)
+            result.emplace_back(std::string((*it).first.view()), (*it).second);
+        return result;
+    }
+
+    // Runs random operations against a vector of the expected entries.
+    void test_operations()
+    {
+        std::mt19937 random(39);
+        interned m;
+        std::vector<std::pair<std::string, int>> expected;
+
+        auto find = [&expected](std::string const &k) {
+            auto it = expected.begin();
+            while (it != expected.end() && it->first != k)
+                ++it;
+            return it;
+        };
+
+        for (int op = 0; op < 20000; ++op) {
+            // keys long enough for erased ones to be reclaimed
+            std::string k = "key " + std::to_string(random() % 500) + std::string(random() % 300, 'x');
+            auto it = find(k);
+
+            switch (random() % 5) {
+            case 0:
+            case 1:
+                assert(m.insert(k, op) == (it == expected.end()));
+                if (it == expected.end())
+                    expected.emplace_back(k, op);
+                else
+                    std::rotate(it, it + 1, expected.end());
+                break;
+            case 2:
+                if (it != expected.end()) {
+                    m.erase(k);
+                    expected.erase(it);
+                }
+                break;
+            case 3:
+                if (it != expected.end()) {
+                    m.at(k) = -op;
+                    it->second = -op;
+                }
+                break;
+            case 4:
+                if (!expected.empty()) {
+                    m.pop_front();
+                    expected.erase(expected.begin());
+                }
+                break;
+            }
+
+            assert(m.contains(k) == (find(k) != expected.end()));
+            if (op % 1000 == 0)
+                assert(entries(m) == expected);
+        }
+        assert(entries(m) == expected);
+        assert(m.size() == expected.size());
+
+        // erased keys are reclaimed once they outweigh live ones
+        size_t live = 0;
+        for (auto const &e : expected)
+            live += e.first.size();
+        assert(m.key_bytes() <= 2 * live + 64 * 1024);
+    }
+
+    void test_copies()
+    {
+        interned m;
+        m.insert("a", 1);
+        m.insert("b", 2);
+
+        interned copy(m);
+        copy.insert("c", 3);
+        copy.at("a") = 10;
+        m.erase("b");
+
+        assert((entries(m) == std::vector<std::pair<std::string, int>>{{"a", 1}}));
+        assert((entries(copy) == std::vector<std::pair<std::string, int>>{{"a", 10}, {"b", 2}, {"c", 3}}));
+
+        m.clear();
+        assert(m.empty() && m.key_bytes() == 0);
+        assert(copy.at("b") == 2);
+    }
+
+    // A map, or a copy, holding two short keys allocates little for them.
+    void test_small_arenas()
+    {
+        size_t before = allocated_bytes;
+        interned m;
+        m.insert("one", 1);
+        m.insert("two", 2);
+        assert(allocated_bytes - before < 1024);
+
+        before = allocated_bytes;
+        interned copy(m);
+        copy.erase("two");
+        copy.insert("three", 3);
+        assert(allocated_bytes - before < 1024);
+
+        // chunks grow with the keys stored
+        before = allocated_bytes;
+        for (int i = 0; i < 10000; ++i)
+            m.insert("key " + std::to_string(i), i);
+        assert(m.size() == 10002 && m.at("key 9999") == 9999);
+        assert(allocated_bytes - before < 4 * 1024 * 1024);
+    }
+}
+
+int main()
+{
+    test_operations();
+    test_copies();
+    test_small_arenas();
+
+    return 0;
+}
@@ -0,0 +1,238 @@
+#ifndef _MAPPED_INSERTION_ORDERED_MAP_H
+#define _MAPPED_INSERTION_ORDERED_MAP_H
+
+#include "insertion_ordered_map.h"
+
+#include <cstddef>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+ * Read-only view of an insertion_ordered_map stored in a file written by
+ * build(). The file holds the entries in insertion order followed by a flat
+ * open-addressing index, and is mapped with mmap, so opening is O(1) and the
+ * pages are shared by every process that maps the same file.
+ *
+ * Hash must give the same values in the builder and in every reader, so
+ * unlike insertion_ordered_map it defaults to the unseeded std::hash. Its
+ * values are mixed with a fixed seed before picking a slot, so that the
+ * identity std::hash of sequential or strided keys does not fill the index
+ * with clusters. The source map given to build() may use any hash.
+ *
+ * Opening checks that the header describes a file of the right size and
+ * layout; the index is checked as it is probed, and at() and contains()
+ * throw serialization_error if it points outside the entries.
+ */
+template <class K, class V, class Hash = std::hash<K>>
+class mapped_insertion_ordered_map {
+    static_assert(std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value,
+                  "mapped_insertion_ordered_map requires trivially copyable keys and values");
+
+public:
+    struct entry {
+        K first;
+        V second;
+    };
+
+    using iterator = entry const *;
+
+private:
+    struct header {
+        std::uint64_t magic;
+        std::uint64_t count;
+        std::uint64_t slot_count;   // power of two
+        std::uint64_t key_size;
+        std::uint64_t value_size;
+        std::uint64_t entries_offset;
+        std::uint64_t slots_offset;
+    };
+
+    // slot value 0 is empty, otherwise it is the entry index + 1
+    using slot_type = std::uint64_t;
+
+    class mapping {
+    public:
+        void *address;
+        size_t length;
+
+        mapping(void *address, size_t length) :
+                address(address),
+                length(length) {}
+
+        mapping(mapping const &) = delete;
+
+        ~mapping() {
+            munmap(address, length);
+        }
+    };
+
+    std::shared_ptr<mapping const> file;
+    entry const *entries;
+    slot_type const *slots;
+    std::uint64_t count;
+    std::uint64_t slot_mask;
+
+    static constexpr std::uint64_t file_magic = 0x32504d4d4f49ULL; // "IOMMP2"
+    static constexpr std::uint64_t index_seed = 0x2d358dccaa6c78a5ULL;
+
+    static std::uint64_t align_up(std::uint64_t offset, std::uint64_t alignment) {
+        return (offset + alignment - 1) / alignment * alignment;
+    }
+
+    // The home slot of k in an index of mask + 1 slots.
+    static std::uint64_t home(K const &k, std::uint64_t mask) {
+        return iom_hash_bits(Hash()(k), index_seed) & mask;
+    }
+
+    /*
+     * The slots come from the file, so they are checked as they are read:
+     * a slot pointing past the entries is an error, and a probe gives up
+     * after visiting every slot once.
+     */
+    entry const *find(K const &k) const {
+        std::uint64_t i = home(k, slot_mask);
+
+        for(std::uint64_t probed = 0; probed <= slot_mask && slots[i] != 0; probed++) {
+            if(slots[i] - 1 >= count) throw serialization_error();
+
+            entry const *e = entries + (slots[i] - 1);
+            if(e->first == k)
+                return e;
+            i = (i + 1) & slot_mask;
+        }
+        return nullptr;
+    }
+
+    // Whether length bytes hold count items of the given size from offset.
+    static bool fits(std::uint64_t offset, std::uint64_t count, std::uint64_t size,
+                     std::uint64_t alignment, std::uint64_t length) {
+        return offset % alignment == 0 && offset <= length && count <= (length - offset) / size;
+    }
+
+public:
+
+    explicit mapped_insertion_ordered_map(std::string const &path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if(fd < 0) throw serialization_error();
+
+        struct stat st;
+        if(fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(header)) {
+            close(fd);
+            throw serialization_error();
+        }
+
+        size_t length = st.st_size;
+        void *address = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if(address == MAP_FAILED) throw serialization_error();
+
+        file = std::make_shared<mapping const>(address, length);
+
+        header const *h = static_cast<header const *>(address);
+        if(h->magic != file_magic || h->key_size != sizeof(K) || h->value_size != sizeof(V)
+           || h->slot_count == 0 || (h->slot_count & (h->slot_count - 1)) != 0
+           || !fits(h->entries_offset, h->count, sizeof(entry), alignof(entry), length)
+           || !fits(h->slots_offset, h->slot_count, sizeof(slot_type), alignof(slot_type), length))
+            throw serialization_error();
+
+        char const *base = static_cast<char const *>(address);
+        entries = reinterpret_cast<entry const *>(base + h->entries_offset);
+        slots = reinterpret_cast<slot_type const *>(base + h->slots_offset);
+        count = h->count;
+        slot_mask = h->slot_count - 1;
+    }
+
+    /*
+     * Writes the entries of source in insertion order together with the
+     * index, in the layout expected by the constructor. The file is written
+     * as path + ".partial" and renamed over path when complete, so readers
+     * that mapped the previous file keep reading it, whole. Entries are
+     * copied field by field into a zeroed buffer, so that their padding is
+     * written as zeros rather than whatever the stack held.
+     */
+    template <class SourceHash>
+    static void build(std::string const &path,
+                      insertion_ordered_map<K, V, SourceHash> const &source) {
+        std::uint64_t built_count = source.size();
+        std::uint64_t slot_count = 2;
+        while(slot_count < 2 * built_count)
+            slot_count *= 2;
+
+        std::vector<char> built(built_count * sizeof(entry), 0);
+        std::vector<slot_type> index(slot_count, 0);
+        std::uint64_t e = 0;
+        for(auto it = source.begin(), end = source.end(); it != end; ++it, ++e) {
+            K const &k = (*it).first;
+            std::memcpy(built.data() + e * sizeof(entry) + offsetof(entry, first), &k, sizeof(K));
+            std::memcpy(built.data() + e * sizeof(entry) + offsetof(entry, second), &(*it).second, sizeof(V));
+
+            std::uint64_t i = home(k, slot_count - 1);
+            while(index[i] != 0)
+                i = (i + 1) & (slot_count - 1);
+            index[i] = e + 1;
+        }
+
+        header h;
+        h.magic = file_magic;
+        h.count = built_count;
+        h.slot_count = slot_count;
+        h.key_size = sizeof(K);
+        h.value_size = sizeof(V);
+        h.entries_offset = align_up(sizeof(header), alignof(entry) > 64 ? alignof(entry) : 64);
+        h.slots_offset = align_up(h.entries_offset + built.size(), alignof(slot_type));
+
+        std::string partial = path + ".partial";
+        std::ofstream os(partial, std::ios::binary | std::ios::trunc);
+        if(!os) throw serialization_error();
+
+        size_t entries_padding = h.entries_offset - sizeof(header);
+        size_t slots_padding = h.slots_offset - h.entries_offset - built.size();
+        std::vector<char> padding(std::max(entries_padding, slots_padding), 0);
+
+        os.write(reinterpret_cast<char const *>(&h), sizeof(h));
+        os.write(padding.data(), entries_padding);
+        os.write(built.data(), built.size());
+        os.write(padding.data(), slots_padding);
+        os.write(reinterpret_cast<char const *>(index.data()), index.size() * sizeof(slot_type));
+
+        os.close();
+        if(!os || std::rename(partial.c_str(), path.c_str()) != 0) {
+            std::remove(partial.c_str());
+            throw serialization_error();
+        }
+    }
+
+    V const &at(K const &k) const {
+        entry const *e = find(k);
+        if(e == nullptr) throw lookup_error();
+
+        return e->second;
+    }
+
+    bool contains(K const &k) const {
+        return find(k) != nullptr;
+    }
+
+    size_t size() const noexcept {
+        return count;
+    }
+
+    bool empty() const noexcept {
+        return size() == 0;
+    }
+
+    // Iterators //
+
+    iterator begin() const {
+        return entries;
+    }
+
+    iterator end() const {
+        return entries + count;
+    }
+};
+
+#endif
@@ -0,0 +1,197 @@
+// Tests of mapped_insertion_ordered_map.h. Build and run with
+//     g++ -std=c++17 -pthread -fsanitize=address,undefined mapped_insertion_ordered_map_test.cpp && ./a.out
+
+#include "mapped_insertion_ordered_map.h"
+
+#include <cassert>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace {
+    using mapped = mapped_insertion_ordered_map<std::uint64_t, std::uint64_t>;
+
+    std::string const path = "mapped_insertion_ordered_map_test.iom";
+
+    bool open_fails()
+    {
+        try {
+            mapped m(path);
+        }
+        catch (serialization_error const &) {
+            return true;
+        }
+        return false;
+    }
+
+    std::vector<std::uint64_t> read_file()
+    {
+        std::ifstream is(path, std::ios::binary);
+        std::vector<std::uint64_t> words;
+        std::uint64_t word;
+        while (is.read(reinterpret_cast<char *>(&word), sizeof(word)))
+            words.push_back(word);
+        return words;
+    }
+
+    void write_file(std::vector<std::uint64_t> const &words)
+    {
+        std::ofstream os(path, std::ios::binary | std::ios::trunc);
+        os.write(reinterpret_cast<char const *>(words.data()), words.size() * sizeof(std::uint64_t));
+    }
+
+    // Header fields, in words.
+    enum { magic, count, slot_count, key_size, value_size, entries_offset, slots_offset };
+
+    void test_lookup()
+    {
+        insertion_ordered_map<std::uint64_t, std::uint64_t> source;
+        for (std::uint64_t i = 0; i < 1000; ++i)
+            source.insert(i * 3, i);
+        source.insert(0, 0);
+
+        mapped::build(path, source);
+        mapped m(path);
+        assert(m.size() == 1000);
+        assert(m.at(3) == 1 && m.at(0) == 0);
+        assert(!m.contains(1));
+
+        auto it = m.begin();
+        for (auto s = source.begin(), end = source.end(); s != end; ++s, ++it)
+            assert(it->first == (*s).first && it->second == (*s).second);
+        assert(it == m.end());
+
+        mapped::build(path, insertion_ordered_map<std::uint64_t, std::uint64_t>());
+        mapped empty(path);
+        assert(empty.empty() && !empty.contains(0));
+    }
+
+    // Strided keys, which std::hash leaves as they are, spread over the
+    // index; unmixed, they took quadratic time to build and look up.
+    void test_strided_keys()
+    {
+        insertion_ordered_map<std::uint64_t, std::uint64_t> source;
+        for (std::uint64_t i = 0; i < 40000; ++i)
+            source.insert(i << 20, i);
+
+        mapped::build(path, source);
+        mapped m(path);
+        for (std::uint64_t i = 0; i < 40000; ++i)
+            assert(m.at(i << 20) == i && !m.contains((i << 20) + 1));
+    }
+
+    // A reader keeps the file it mapped when the table is rebuilt.
+    void test_rebuild()
+    {
+        insertion_ordered_map<std::uint64_t, std::uint64_t> source;
+        for (std::uint64_t i = 0; i < 100000; ++i)
+            source.insert(i, i);
+        mapped::build(path, source);
+        mapped old(path);
+
+        mapped::build(path, insertion_ordered_map<std::uint64_t, std::uint64_t>());
+        std::uint64_t sum = 0;
+        for (auto const &e : old)
+            sum += e.second;
+        assert(sum == 99999ull * 100000 / 2);
+        assert(old.at(99999) == 99999);
+        assert(mapped(path).empty());
+    }
+
+    // The padding between a key and its value is written as zeros.
+    void test_padding()
+    {
+        using padded = mapped_insertion_ordered_map<std::uint32_t, std::uint64_t>;
+        static_assert(sizeof(padded::entry) == 2 * sizeof(std::uint64_t));
+
+        insertion_ordered_map<std::uint32_t, std::uint64_t> source;
+        for (std::uint32_t k = 0; k < 1000; ++k)
+            source.insert(~k, k);
+        padded::build(path, source);
+        std::vector<std::uint64_t> words = read_file();
+
+        size_t entries = words[entries_offset] / sizeof(std::uint64_t);
+        for (std::uint32_t k = 0; k < 1000; ++k) {
+            std::uint64_t key_word = words[entries + 2 * k];
+            assert(key_word == ~k || key_word == std::uint64_t(~k) << 32);
+            assert(words[entries + 2 * k + 1] == k);
+        }
+        assert(padded(path).at(~std::uint32_t(0)) == 0);
+    }
+
+    void test_corrupt()
+    {
+        insertion_ordered_map<std::uint64_t, std::uint64_t> source;
+        for (std::uint64_t i = 0; i < 10; ++i)
+            source.insert(i, i);
+        mapped::build(path, source);
+        std::vector<std::uint64_t> good = read_file();
+
+        std::vector<std::uint64_t> bad = good;
+        bad.resize(bad.size() - 1);
+        write_file(bad);
+        assert(open_fails());
+
+        // offset + count * sizeof(entry) wraps around
+        bad = good;
+        bad[count] = (std::uint64_t(1) << 60) + 1;
+        write_file(bad);
+        assert(open_fails());
+
+        bad = good;
+        bad[slots_offset] = ~std::uint64_t(0) - 7;
+        write_file(bad);
+        assert(open_fails());
+
+        bad = good;
+        bad[entries_offset] += 1;
+        write_file(bad);
+        assert(open_fails());
+
+        bad = good;
+        bad[slot_count] = 3;
+        write_file(bad);
+        assert(open_fails());
+
+        // slots pointing past the entries
+        bad = good;
+        size_t slots = bad[slots_offset] / sizeof(std::uint64_t);
+        for (size_t i = 0; i < bad[slot_count]; ++i)
+            bad[slots + i] = bad[count] + 1;
+        write_file(bad);
+        {
+            mapped m(path);
+            bool failed = false;
+            try {
+                m.contains(5);
+            }
+            catch (serialization_error const &) {
+                failed = true;
+            }
+            assert(failed);
+        }
+
+        // no empty slot: lookups of absent keys still end
+        bad = good;
+        for (size_t i = 0; i < bad[slot_count]; ++i)
+            bad[slots + i] = 1 + i % bad[count];
+        write_file(bad);
+        {
+            mapped m(path);
+            assert(!m.contains(12345));
+        }
+    }
+}
+
+int main()
+{
+    test_lookup();
+    test_strided_keys();
+    test_rebuild();
+    test_padding();
+    test_corrupt();
+    std::remove(path.c_str());
+
+    return 0;
+}
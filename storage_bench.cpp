@@ -0,0 +1,119 @@
+// Benchmark of copy-on-write, clear() and serialization for trivially
+// copyable entries, against entries of the same size that are not. Build
+// and run with
+//     g++ -std=c++17 -O2 -pthread storage_bench.cpp && ./a.out
+
+#include "insertion_ordered_map.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <sstream>
+
+namespace {
+    // A std::uint64_t with a user-provided copy, so it takes the entry by entry paths.
+    struct wrapped {
+        std::uint64_t value;
+
+        wrapped(std::uint64_t value = 0) :
+                value(value) {}
+
+        wrapped(wrapped const &other) :
+                value(other.value) {}
+
+        wrapped &operator=(wrapped const &other)
+        {
+            value = other.value;
+            return *this;
+        }
+
+        ~wrapped() {}
+
+        bool operator==(wrapped const &other) const
+        {
+            return value == other.value;
+        }
+    };
+
+    struct wrapped_hash {
+        size_t operator()(wrapped const &w) const
+        {
+            return iom_hash<std::uint64_t>()(w.value);
+        }
+    };
+}
+
+// Serialized like a std::uint64_t, but one entry at a time.
+template <>
+struct iom_serializer<wrapped> {
+    static void write(std::ostream &os, wrapped const &w)
+    {
+        iom_serializer<std::uint64_t>::write(os, w.value);
+    }
+
+    static wrapped read(std::istream &is)
+    {
+        return wrapped(iom_serializer<std::uint64_t>::read(is));
+    }
+};
+
+namespace {
+    constexpr std::uint64_t entries = 2000000;
+    constexpr int runs = 5;
+
+    double since(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    /*
+     * Times owning every page of a copy with step(), which copies each
+     * shared page, and the clear() of the copy, which then owns them. Then
+     * times saving the map to memory and loading it back.
+     */
+    template <class K, class V, class Hash>
+    void run(char const *name)
+    {
+        insertion_ordered_map<K, V, Hash> m;
+        for (std::uint64_t i = 0; i < entries; ++i)
+            m.insert(K(i), V(i));
+
+        double copy = 0, clear = 0, save = 0, load = 0;
+        for (int run = 0; run < runs; ++run) {
+            insertion_ordered_map<K, V, Hash> copied(m);
+            copied.update(K(0), [](V &v) { v = V(1); });
+
+            auto start = std::chrono::steady_clock::now();
+            copied.step(entries);
+            copy += since(start);
+
+            start = std::chrono::steady_clock::now();
+            copied.clear();
+            clear += since(start);
+
+            std::ostringstream os;
+            start = std::chrono::steady_clock::now();
+            m.save(os);
+            save += since(start);
+
+            std::istringstream is(os.str());
+            start = std::chrono::steady_clock::now();
+            copied.load(is);
+            load += since(start);
+            if (copied.size() != m.size())
+                std::printf("wrong result\n");
+        }
+
+        std::printf("%-20s copy-on-write %6.1f ms, clear() %5.1f ms, save %6.1f ms, load %6.1f ms\n",
+                    name, copy / runs, clear / runs, save / runs, load / runs);
+    }
+}
+
+int main()
+{
+    std::printf("%llu entries, mean of %d runs\n", static_cast<unsigned long long>(entries), runs);
+    run<std::uint64_t, std::uint64_t, iom_hash<std::uint64_t>>("uint64_t -> uint64_t");
+    run<wrapped, wrapped, wrapped_hash>("wrapped -> wrapped");
+
+    return 0;
+}